@@ -2,23 +2,246 @@
 
 /* ------------------------------------------------------------------ */
 
+static void connect_free(struct vconsole_connect *conn);
+static void connect_error_show(struct vconsole_connect *conn, int level,
+                               int code, int domain, const char *message);
+
+/*
+ * The libvirt callbacks below package the event into a struct
+ * connect_event and hand it to connect_event_run() on the gtk main
+ * loop.  With the libvirt event loop in its own thread (see
+ * event-thread in vconsole(1)) they run there, then the event is
+ * queued and connect_dispatch() runs the handlers, in order, all
+ * pending events in one go.
+ *
+ * Domain events are registered by the connect worker before it lists
+ * the guests, so nothing is lost between listing and connect_done().
+ * Events arriving meanwhile are parked in conn->early and replayed
+ * once the guests are added.
+ *
+ * The callbacks get the connection id, not the struct, as opaque.
+ * Events may still be queued (or a worker may still be reporting an
+ * error) when connect_free() runs, connect_event_run() looks up the
+ * id and drops events for connections which are gone.
+ */
+
+enum connect_event_type {
+    CONNECT_EVENT_LIFECYCLE,
+    CONNECT_EVENT_REBOOT,
+    CONNECT_EVENT_BALLOON,
+    CONNECT_EVENT_JOB_COMPLETED,
+    CONNECT_EVENT_CLOSE,
+    CONNECT_EVENT_ERROR,
+};
+
+struct connect_event {
+    enum connect_event_type   type;
+    guint                     id;
+    virDomainPtr              d;
+    int                       event, detail;
+    unsigned long long        actual;
+
+    /* errors */
+    int                       level, code, domain;
+    char                      *message;
+};
+
+static GAsyncQueue *connect_events;
+static gint connect_events_pending;
+
+/* live connections, id -> vconsole_connect, gtk thread only */
+static GHashTable *connects;
+static guint connect_serial;
+
+static void connect_event_free(struct connect_event *ev)
+{
+    if (ev->d)
+        virDomainFree(ev->d);
+    g_free(ev->message);
+    g_free(ev);
+}
+
+/* gtk thread, consumes the event */
+static void connect_event_run(struct connect_event *ev)
+{
+    struct vconsole_connect *conn;
+
+    /* host might be gone meanwhile */
+    conn = g_hash_table_lookup(connects, GUINT_TO_POINTER(ev->id));
+    if (!conn) {
+        if (debug)
+            fprintf(stderr, "%s: connection #%u gone, event %d dropped\n",
+                    __func__, ev->id, ev->type);
+        connect_event_free(ev);
+        return;
+    }
+    if (!conn->ptr) {
+        /* still connecting, replayed by connect_done() */
+        g_queue_push_tail(&conn->early, ev);
+        return;
+    }
+
+    switch (ev->type) {
+    case CONNECT_EVENT_LIFECYCLE:
+        domain_update(conn, ev->d, ev->event, ev->detail);
+        break;
+    case CONNECT_EVENT_REBOOT:
+        domain_event_reboot(conn, ev->d);
+        break;
+    case CONNECT_EVENT_BALLOON:
+        domain_event_balloon(conn, ev->d, ev->actual);
+        break;
+    case CONNECT_EVENT_JOB_COMPLETED:
+        domain_event_job_completed(conn, ev->d);
+        break;
+    case CONNECT_EVENT_CLOSE:
+        connect_close(NULL, ev->event, conn);
+        break;
+    case CONNECT_EVENT_ERROR:
+        connect_error_show(conn, ev->level, ev->code, ev->domain,
+                           ev->message);
+        break;
+    }
+    connect_event_free(ev);
+}
+
+static gboolean connect_dispatch(gpointer opaque)
+{
+    struct connect_event *ev;
+
+    g_atomic_int_set(&connect_events_pending, 0);
+    while ((ev = g_async_queue_try_pop(connect_events)) != NULL)
+        connect_event_run(ev);
+    return FALSE;
+}
+
+/* event thread or guest action worker, must not touch gtk */
+static gboolean connect_off_thread(void)
+{
+    return !g_main_context_is_owner(g_main_context_default());
+}
+
+static struct connect_event *connect_event_new(void *opaque,
+                                               enum connect_event_type type,
+                                               virDomainPtr d)
+{
+    struct connect_event *ev;
+
+    ev = g_new0(struct connect_event, 1);
+    ev->type = type;
+    ev->id = GPOINTER_TO_UINT(opaque);
+    if (d) {
+        virDomainRef(d);
+        ev->d = d;
+    }
+    return ev;
+}
+
+static void connect_event_queue(struct connect_event *ev)
+{
+    g_async_queue_push(connect_events, ev);
+    if (g_atomic_int_compare_and_exchange(&connect_events_pending, 0, 1))
+        g_idle_add(connect_dispatch, NULL);
+}
+
+static void connect_event_post(struct connect_event *ev)
+{
+    if (!connect_off_thread()) {
+        connect_event_run(ev);
+        return;
+    }
+    connect_event_queue(ev);
+}
+
 static int connect_domain_event(virConnectPtr c, virDomainPtr d,
                                 int event, int detail, void *opaque)
 {
-    struct vconsole_connect *conn = opaque;
+    struct connect_event *ev;
 
     if (debug)
-        fprintf(stderr, "%s: %s, event %d\n", __func__,
-                virDomainGetName(d), event);
-    domain_update(conn, d, event);
+        fprintf(stderr, "%s: %s, event %d, detail %d\n", __func__,
+                virDomainGetName(d), event, detail);
+    ev = connect_event_new(opaque, CONNECT_EVENT_LIFECYCLE, d);
+    ev->event = event;
+    ev->detail = detail;
+    connect_event_post(ev);
     return 0;
 }
 
+static void connect_domain_reboot(virConnectPtr c, virDomainPtr d,
+                                  void *opaque)
+{
+    if (debug)
+        fprintf(stderr, "%s: %s\n", __func__, virDomainGetName(d));
+    connect_event_post(connect_event_new(opaque, CONNECT_EVENT_REBOOT, d));
+}
+
+#if LIBVIR_VERSION_NUMBER >= 10000 /* 0.10.0 */
+static void connect_domain_balloon(virConnectPtr c, virDomainPtr d,
+                                   unsigned long long actual, void *opaque)
+{
+    struct connect_event *ev;
+
+    if (debug > 1)
+        fprintf(stderr, "%s: %s, %llu kB\n", __func__,
+                virDomainGetName(d), actual);
+    ev = connect_event_new(opaque, CONNECT_EVENT_BALLOON, d);
+    ev->actual = actual;
+    connect_event_post(ev);
+}
+#endif
+
+#if LIBVIR_VERSION_NUMBER >= 1003003 /* 1.3.3 */
+static void connect_domain_job_completed(virConnectPtr c, virDomainPtr d,
+                                         virTypedParameterPtr params,
+                                         int nparams, void *opaque)
+{
+    if (debug)
+        fprintf(stderr, "%s: %s\n", __func__, virDomainGetName(d));
+    connect_event_post(connect_event_new(opaque, CONNECT_EVENT_JOB_COMPLETED,
+                                           d));
+}
+#endif
+
+/*
+ * Register for the specific events we care about, so each one only
+ * touches the fields it affects.  Tunable and metadata changes don't
+ * affect anything we show, so we don't ask for them.
+ */
+static void connect_register_events(virConnectPtr c, void *opaque, int *ids)
+{
+    ids[0] = virConnectDomainEventRegisterAny
+        (c, NULL, VIR_DOMAIN_EVENT_ID_LIFECYCLE,
+         VIR_DOMAIN_EVENT_CALLBACK(connect_domain_event), opaque, NULL);
+    ids[1] = virConnectDomainEventRegisterAny
+        (c, NULL, VIR_DOMAIN_EVENT_ID_REBOOT,
+         VIR_DOMAIN_EVENT_CALLBACK(connect_domain_reboot), opaque, NULL);
+#if LIBVIR_VERSION_NUMBER >= 10000 /* 0.10.0 */
+    ids[2] = virConnectDomainEventRegisterAny
+        (c, NULL, VIR_DOMAIN_EVENT_ID_BALLOON_CHANGE,
+         VIR_DOMAIN_EVENT_CALLBACK(connect_domain_balloon), opaque, NULL);
+#endif
+#if LIBVIR_VERSION_NUMBER >= 1003003 /* 1.3.3 */
+    ids[3] = virConnectDomainEventRegisterAny
+        (c, NULL, VIR_DOMAIN_EVENT_ID_JOB_COMPLETED,
+         VIR_DOMAIN_EVENT_CALLBACK(connect_domain_job_completed), opaque, NULL);
+#endif
+}
+
+static void connect_deregister_events(virConnectPtr c, int *ids)
+{
+    int i;
+
+    for (i = 0; i < CONNECT_EVENT_IDS; i++) {
+        if (ids[i] >= 0)
+            virConnectDomainEventDeregisterAny(c, ids[i]);
+        ids[i] = -1;
+    }
+}
+
 static void connect_error(void *opaque, virErrorPtr err)
 {
-    struct vconsole_connect *conn = opaque;
-    GtkMessageType type;
-    GtkWidget **dialog;
+    struct connect_event *ev;
 
     switch (err->domain) {
     case VIR_FROM_STREAMS:  /* get one on guest shutdown, ignore */
@@ -34,7 +257,21 @@ static void connect_error(void *opaque, virErrorPtr err)
         break;
     }
 
-    switch (err->level) {
+    ev = connect_event_new(opaque, CONNECT_EVENT_ERROR, NULL);
+    ev->level = err->level;
+    ev->code = err->code;
+    ev->domain = err->domain;
+    ev->message = g_strdup(err->message);
+    connect_event_post(ev);
+}
+
+static void connect_error_show(struct vconsole_connect *conn, int level,
+                               int code, int domain, const char *message)
+{
+    GtkMessageType type;
+    GtkWidget **dialog;
+
+    switch (level) {
     case VIR_ERR_WARNING:
         type = GTK_MESSAGE_WARNING;
         dialog = &conn->warn;
@@ -50,136 +287,391 @@ static void connect_error(void *opaque, virErrorPtr err)
     }
     gtk_message(conn->win->toplevel, dialog, type,
                 "%s [ %d / %d ]\n",
-                err->message,
-                err->code, err->domain);
+                message, code, domain);
 }
 
+/*
+ * libvirt close callback.  Always goes through the queue, connect_free()
+ * unregisters the callback, which must not happen from within it.
+ */
+static void connect_closed(virConnectPtr c, int reason, void *opaque)
+{
+    struct connect_event *ev;
+
+    ev = connect_event_new(opaque, CONNECT_EVENT_CLOSE, NULL);
+    ev->event = reason;
+    connect_event_queue(ev);
+}
+
+/* gtk thread */
 void connect_close(virConnectPtr c, int reason, void *opaque)
 {
     struct vconsole_connect *conn = opaque;
-    GtkTreeModel *model = GTK_TREE_MODEL(conn->win->store);
-    struct vconsole_domain *dom = NULL;
-    GtkTreeIter host, guest;
-    gboolean rc;
-    void *ptr;
+    struct vconsole_window *win = conn->win;
+    struct vconsole_domain *dom;
+    GHashTableIter iter;
 
     if (debug)
         fprintf(stderr, "%s: reason %d\n", __func__, reason);
 
-    /* find host */
-    rc = gtk_tree_model_get_iter_first(model, &host);
-    while (rc) {
-        gtk_tree_model_get(model, &host,
-                           CPTR_COL, &ptr,
-                           -1);
-        if (ptr == conn)
-            break;
-        rc = gtk_tree_model_iter_next(model, &host);
-    }
-    assert(ptr == conn);
+    if (!g_hash_table_contains(win->hosts, conn))
+        return;
 
     /* free all guests */
-    while ((rc = gtk_tree_model_iter_nth_child(model, &guest, &host, 0))) {
-        gtk_tree_model_get(model, &guest,
-                           DPTR_COL, &dom,
-                           -1);
-        gtk_tree_store_remove(conn->win->store, &guest);
+    g_hash_table_iter_init(&iter, conn->domains);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&dom)) {
+        g_hash_table_iter_remove(&iter);
         domain_free(dom);
     }
 
     /* free host */
-    gtk_tree_store_remove(conn->win->store, &host);
-    g_free(conn);
+    connect_free(conn);
+}
+
+/* ------------------------------------------------------------------ */
+
+/*
+ * Connection setup runs in a worker thread, so an unreachable host
+ * doesn't block the main loop.  The worker fills struct connect_work,
+ * connect_done() picks up the results in the main thread.
+ */
+
+struct connect_guest {
+    virDomainPtr              d;
+    virDomainInfo             info;
+    gboolean                  saved;
+};
+
+struct connect_work {
+    char                      *uri;
+    guint                     id;        /* event opaque */
+    virConnectPtr             ptr;
+    int                       event_ids[CONNECT_EVENT_IDS];
+    const char                *type;
+    char                      *name;
+    gboolean                  cap_migration;
+    gboolean                  cap_bulk_stats;
+    GArray                    *guests;
+    gint64                    start, listed;
+};
+
+static void connect_work_free(gpointer data)
+{
+    struct connect_work *work = data;
+    struct connect_guest *guest;
+    guint i;
+
+    for (i = 0; i < work->guests->len; i++) {
+        guest = &g_array_index(work->guests, struct connect_guest, i);
+        virDomainFree(guest->d);
+    }
+    g_array_free(work->guests, TRUE);
+    if (work->ptr) {
+        connect_deregister_events(work->ptr, work->event_ids);
+        virConnectClose(work->ptr);
+    }
+    free(work->name);
+    g_free(work->uri);
+    g_free(work);
 }
 
-static void connect_list(struct vconsole_connect *conn)
+static void connect_list(struct connect_work *work)
 {
-    virDomainPtr d;
+    virDomainPtr *domains = NULL, *saved = NULL;
+    GHashTable *index;
+    struct connect_guest guest, *g;
+    char uuid[VIR_UUID_STRING_BUFLEN];
+    gboolean bulk;
     int i, n;
-    char **inactive;
-    int *active;
 
-    n = virConnectNumOfDomains(conn->ptr);
-    active = malloc(sizeof(int) * n);
-    n = virConnectListDomains(conn->ptr, active, n);
+    /* all guests, one call */
+    n = virConnectListAllDomains(work->ptr, &domains, 0);
+    if (n < 0)
+        return;
+
+    index = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
     for (i = 0; i < n; i++) {
-        d = virDomainLookupByID(conn->ptr, active[i]);
-        domain_update(conn, d, -1);
-        virDomainFree(d);
+        memset(&guest, 0, sizeof(guest));
+        guest.d = domains[i];
+        g_array_append_val(work->guests, guest);
+        virDomainGetUUIDString(domains[i], uuid);
+        g_hash_table_insert(index, g_strdup(uuid), GINT_TO_POINTER(i));
     }
-    free(active);
 
-    n = virConnectNumOfDefinedDomains(conn->ptr);
-    inactive = malloc(sizeof(char *) * n);
-    n = virConnectListDefinedDomains(conn->ptr, inactive, n);
-    for (i = 0; i < n; i++) {
-        d = virDomainLookupByName(conn->ptr, inactive[i]);
-        domain_update(conn, d, -1);
-        virDomainFree(d);
-        free(inactive[i]);
+    /* guests with managed save image, one call */
+    if (work->cap_migration) {
+        n = virConnectListAllDomains(work->ptr, &saved,
+                                     VIR_CONNECT_LIST_DOMAINS_MANAGEDSAVE);
+        for (i = 0; i < n; i++) {
+            virDomainGetUUIDString(saved[i], uuid);
+            if (g_hash_table_contains(index, uuid)) {
+                g = &g_array_index(work->guests, struct connect_guest,
+                                   GPOINTER_TO_INT(g_hash_table_lookup(index, uuid)));
+                g->saved = TRUE;
+            }
+            virDomainFree(saved[i]);
+        }
+        free(saved);
+    }
+
+    /* guest info, one call if supported */
+    bulk = FALSE;
+#if LIBVIR_VERSION_NUMBER >= 1002008 /* 1.2.8 */
+    if (work->cap_bulk_stats && work->guests->len) {
+        virDomainStatsRecordPtr *records = NULL;
+        virErrorPtr err;
+
+        n = virDomainListGetStats(domains, DOMAIN_STATS, &records, 0);
+        for (i = 0; i < n; i++) {
+            virDomainGetUUIDString(records[i]->dom, uuid);
+            if (!g_hash_table_contains(index, uuid))
+                continue;
+            g = &g_array_index(work->guests, struct connect_guest,
+                               GPOINTER_TO_INT(g_hash_table_lookup(index, uuid)));
+            domain_stats_info(records[i], &g->info);
+        }
+        if (n >= 0) {
+            virDomainStatsRecordListFree(records);
+            bulk = TRUE;
+        } else {
+            err = virGetLastError();
+            if (err && err->code == VIR_ERR_NO_SUPPORT)
+                work->cap_bulk_stats = FALSE;
+        }
+    }
+#endif
+    if (!bulk) {
+        for (i = 0; i < work->guests->len; i++) {
+            g = &g_array_index(work->guests, struct connect_guest, i);
+            virDomainGetInfo(g->d, &g->info);
+        }
+    }
+
+    g_hash_table_destroy(index);
+    free(domains);
+}
+
+static void connect_thread(GTask *task, gpointer source,
+                           gpointer data, GCancellable *cancel)
+{
+    struct connect_work *work = data;
+    unsigned long libver;
+    char *caps;
+
+    work->ptr = virConnectOpen(work->uri);
+    if (work->ptr == NULL || g_cancellable_is_cancelled(cancel))
+        goto done;
+
+    work->type = virConnectGetType(work->ptr);
+    work->name = virConnectGetHostname(work->ptr);
+    caps = virConnectGetCapabilities(work->ptr);
+    if (caps && strstr(caps, "<migration_features>"))
+        work->cap_migration = TRUE;
+    free(caps);
+#if LIBVIR_VERSION_NUMBER >= 1002008 /* 1.2.8 */
+    if (strcmp(work->type, "QEMU") == 0 &&
+        virConnectGetLibVersion(work->ptr, &libver) == 0 &&
+        libver >= 1002008)
+        work->cap_bulk_stats = TRUE;
+#endif
+    if (g_cancellable_is_cancelled(cancel))
+        goto done;
+
+    /* before listing, so we don't miss changes, see connect_event_run() */
+    connect_register_events(work->ptr, GUINT_TO_POINTER(work->id),
+                            work->event_ids);
+    connect_list(work);
+    work->listed = g_get_monotonic_time();
+
+done:
+    g_task_return_boolean(task, TRUE);
+}
+
+/* removes guest rows too */
+static void connect_remove_row(struct vconsole_connect *conn)
+{
+    struct vconsole_window *win = conn->win;
+    GtkTreeIter *host;
+
+    host = g_hash_table_lookup(win->hosts, conn);
+    if (host)
+        gtk_tree_store_remove(win->store, host);
+    g_hash_table_remove(win->hosts, conn);
+}
+
+static void connect_free(struct vconsole_connect *conn)
+{
+    /* drops queued events too, see connect_event_run() */
+    g_hash_table_remove(connects, GUINT_TO_POINTER(conn->id));
+    if (conn->ptr) {
+        connect_deregister_events(conn->ptr, conn->event_ids);
+        virConnSetErrorFunc(conn->ptr, NULL, NULL);
+#if LIBVIR_VERSION_NUMBER >= 10000 /* 0.10.0 */
+        virConnectUnregisterCloseCallback(conn->ptr, connect_closed);
+#endif
+        virConnectClose(conn->ptr);
+        conn->ptr = NULL;
     }
-    free(inactive);
+
+    connect_remove_row(conn);
+    g_hash_table_destroy(conn->domains);
+    while (!g_queue_is_empty(&conn->early))
+        connect_event_free(g_queue_pop_head(&conn->early));
+    if (conn->actions) {
+        /* queued actions are skipped, a running one finishes */
+        g_cancellable_cancel(conn->cancel);
+        g_thread_pool_free(conn->actions, FALSE, FALSE);
+    }
+    g_object_unref(conn->cancel);
+    g_free(conn->sortkey);
+    g_free(conn);
+}
+
+static void connect_done(GObject *source, GAsyncResult *res, gpointer opaque)
+{
+    struct vconsole_connect *conn = opaque;
+    struct vconsole_window *win = conn->win;
+    struct connect_work *work = g_task_get_task_data(G_TASK(res));
+    struct connect_guest *guest;
+    GtkTreeIter *host;
+    char *key;
+    guint i;
+
+    if (g_cancellable_is_cancelled(conn->cancel)) {
+        if (debug)
+            fprintf(stderr, "%s: %s: cancelled\n", __func__, work->uri);
+        connect_free(conn);
+        return;
+    }
+    if (work->ptr == NULL) {
+        gtk_message(win->toplevel, NULL, GTK_MESSAGE_ERROR,
+                    "Failed to open connection to %s\n", work->uri);
+        connect_free(conn);
+        return;
+    }
+
+    conn->ptr = work->ptr;
+    work->ptr = NULL;
+    memcpy(conn->event_ids, work->event_ids, sizeof(conn->event_ids));
+    conn->cap_migration = work->cap_migration;
+    conn->cap_bulk_stats = work->cap_bulk_stats;
+    if (strcmp(work->type, "QEMU") == 0) {
+        conn->cap_start_paused = TRUE;
+        conn->cap_console_force = TRUE;
+    }
+    if (debug) {
+        fprintf(stderr, "%s: %s\n", __func__, work->uri);
+        if (conn->cap_migration)
+            fprintf(stderr, "%s: migration supported\n", __func__);
+        if (conn->cap_bulk_stats)
+            fprintf(stderr, "%s: bulk stats supported\n", __func__);
+    }
+
+    virConnSetErrorFunc(conn->ptr, GUINT_TO_POINTER(conn->id),
+                        connect_error);
+#if LIBVIR_VERSION_NUMBER >= 10000 /* 0.10.0 */
+    virConnectRegisterCloseCallback(conn->ptr, connect_closed,
+                                    GUINT_TO_POINTER(conn->id), NULL);
+#endif
+
+    g_free(conn->sortkey);
+    conn->sortkey = g_utf8_collate_key_for_filename(work->name, -1);
+    host = g_hash_table_lookup(win->hosts, conn);
+    if (host)
+        gtk_tree_store_set(win->store, host,
+                           NAME_COL,       work->name,
+                           TYPE_COL,       work->type,
+                           STATE_COL,      NULL,
+                           -1);
+
+    key = g_strdup_printf("%s:%s", work->type, work->name);
+    g_key_file_set_string(config, "hosts", work->name, work->uri);
+    g_key_file_set_string(config, "connections", key, work->uri);
+    config_write();
+    g_free(key);
+
+    tree_bulk_begin(win);
+    for (i = 0; i < work->guests->len; i++) {
+        guest = &g_array_index(work->guests, struct connect_guest, i);
+        domain_add(conn, guest->d, &guest->info, guest->saved);
+    }
+    tree_bulk_end(win);
+
+    /* changes since the guests have been listed */
+    while (!g_queue_is_empty(&conn->early))
+        connect_event_run(g_queue_pop_head(&conn->early));
+    if (debug)
+        fprintf(stderr, "%s: %s: %d guests, listed after %" PRId64
+                " ms, populated after %" PRId64 " ms\n", __func__,
+                work->name, work->guests->len,
+                (work->listed - work->start) / 1000,
+                (g_get_monotonic_time() - work->start) / 1000);
+}
+
+/*
+ * virConnectOpen() can hang until the tcp timeout, so don't wait for
+ * it.  The row goes away right now, the task returns on cancel and
+ * connect_done() frees the host, the worker result is dropped when
+ * the thread finally finishes.
+ */
+void connect_cancel(struct vconsole_connect *conn)
+{
+    if (debug)
+        fprintf(stderr, "%s: #%u\n", __func__, conn->id);
+    connect_remove_row(conn);
+    g_cancellable_cancel(conn->cancel);
 }
 
 struct vconsole_connect *connect_init(struct vconsole_window *win,
                                       const char *uri)
 {
     struct vconsole_connect *conn;
-    GtkTreeIter iter;
-    const char *type;
-    char *name, *key, *caps;
+    struct connect_work *work;
+    GtkTreeIter iter, *host;
+    GTask *task;
+    int i;
 
-    conn = g_new0(struct vconsole_connect, 1);
-    conn->ptr = virConnectOpen(uri);
-    if (conn->ptr == NULL) {
-        gtk_message(win->toplevel, NULL, GTK_MESSAGE_ERROR,
-                    "Failed to open connection to %s\n", uri);
-        g_free(conn);
-        return NULL;
+    if (!connect_events) {
+        connect_events = g_async_queue_new();
+        connects = g_hash_table_new(g_direct_hash, g_direct_equal);
     }
+
+    conn = g_new0(struct vconsole_connect, 1);
     conn->win = win;
-    type = virConnectGetType(conn->ptr);
-    name = virConnectGetHostname(conn->ptr);
-    caps = virConnectGetCapabilities(conn->ptr);
-    key = g_strdup_printf("%s:%s", type, name);
-    virConnectDomainEventRegister(conn->ptr, connect_domain_event,
-                                  conn, NULL);
-    virConnSetErrorFunc(conn->ptr, conn, connect_error);
-#if LIBVIR_VERSION_NUMBER >= 10000 /* 0.10.0 */
-    virConnectRegisterCloseCallback(conn->ptr, connect_close,
-                                    conn, NULL);
-#endif
+    conn->id = ++connect_serial;
+    g_hash_table_insert(connects, GUINT_TO_POINTER(conn->id), conn);
+    conn->domains = g_hash_table_new(g_str_hash, g_str_equal);
+    conn->cancel = g_cancellable_new();
+    conn->sortkey = g_utf8_collate_key_for_filename(uri, -1);
 
+    /* placeholder row, filled in by connect_done() */
     gtk_tree_store_append(win->store, &iter, NULL);
     gtk_tree_store_set(win->store, &iter,
                        CPTR_COL,       conn,
-                       NAME_COL,       name,
-                       TYPE_COL,       type,
+                       NAME_COL,       uri,
                        URI_COL,        uri,
+                       STATE_COL,      "connecting ...",
                        FOREGROUND_COL, win->darkmode ? "white" : "black",
                        WEIGHT_COL,     PANGO_WEIGHT_NORMAL,
                        -1);
+    host = g_new(GtkTreeIter, 1);
+    *host = iter;
+    g_hash_table_insert(win->hosts, conn, host);
 
     if (debug)
         fprintf(stderr, "%s: %s\n", __func__, uri);
-    g_key_file_set_string(config, "hosts", name, uri);
-    g_key_file_set_string(config, "connections", key, uri);
-    config_write();
-    connect_list(conn);
-
-    if (strstr(caps, "<migration_features>")) {
-        if (debug)
-            fprintf(stderr, "%s: migration supported\n", __func__);
-        conn->cap_migration = TRUE;
-    }
-    if (strcmp(type, "QEMU") == 0) {
-        conn->cap_start_paused = TRUE;
-        conn->cap_console_force = TRUE;
-    }
-
-    free(key);
-    free(caps);
-    free(name);
+    work = g_new0(struct connect_work, 1);
+    work->uri = g_strdup(uri);
+    work->id = conn->id;
+    for (i = 0; i < CONNECT_EVENT_IDS; i++)
+        work->event_ids[i] = -1;
+    work->start = g_get_monotonic_time();
+    work->guests = g_array_new(FALSE, FALSE, sizeof(struct connect_guest));
+    task = g_task_new(NULL, conn->cancel, connect_done, conn);
+    g_task_set_task_data(task, work, connect_work_free);
+    g_task_set_return_on_cancel(task, TRUE);
+    g_task_run_in_thread(task, connect_thread);
+    g_object_unref(task);
 
     return conn;
 }
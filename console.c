@@ -0,0 +1,394 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "console.h"
+
+extern int debug;
+
+/* ------------------------------------------------------------------ */
+
+/*
+ * The stream callback gets a link, not the console.  With the libvirt
+ * event loop running in its own thread a callback can still be running
+ * while the console is closed.  The link is refcounted (one reference
+ * for the console, one for libvirt, dropped by the stream free
+ * callback), its lock serializes callbacks against close and send.
+ */
+struct console_link {
+    GRecMutex                 lock;
+    struct console            *con;      /* NULL once closed */
+    gint                      refcount;
+};
+
+static void console_link_ref(struct console_link *link)
+{
+    g_atomic_int_inc(&link->refcount);
+}
+
+static void console_link_unref(void *opaque)
+{
+    struct console_link *link = opaque;
+
+    if (!g_atomic_int_dec_and_test(&link->refcount))
+        return;
+    g_rec_mutex_clear(&link->lock);
+    g_free(link);
+}
+
+/* ------------------------------------------------------------------ */
+
+static void console_tx_watch(struct console *con, bool writable)
+{
+    int events = VIR_STREAM_EVENT_READABLE | VIR_STREAM_EVENT_HANGUP;
+
+    if (writable)
+        events |= VIR_STREAM_EVENT_WRITABLE;
+    virStreamEventUpdateCallback(con->stream, events);
+}
+
+/* send as much of the tx queue as the stream takes without blocking */
+static int console_tx_drain(struct console *con)
+{
+    guint sent = 0;
+    int rc = 0;
+
+    while (sent < con->txbuf->len) {
+        rc = virStreamSend(con->stream, (char *)con->txbuf->data + sent,
+                           con->txbuf->len - sent);
+        if (rc <= 0)
+            break;
+        sent += rc;
+    }
+    g_byte_array_remove_range(con->txbuf, 0, sent);
+    con->tx_sent += sent;
+    if (rc == -1)
+        return -1;
+    return 0;
+}
+
+/* stream is gone (eof, error, hangup) */
+static void console_gone(struct console *con)
+{
+    if (con->defer_close) {
+        /* owner closes from its own thread, just stop events */
+        virStreamEventUpdateCallback(con->stream, 0);
+        con->dead = true;
+    } else {
+        console_close(con);
+    }
+    con->ops->hangup(con->opaque);
+}
+
+static void console_event_locked(struct console *con, virStreamPtr stream,
+                                 int events)
+{
+    int rc = -2, len = 0;
+
+    if (events & VIR_STREAM_EVENT_WRITABLE) {
+        if (console_tx_drain(con) < 0) {
+            if (debug)
+                fprintf(stderr, "%s: %s send error\n", __func__, con->name);
+            console_gone(con);
+            return;
+        }
+        if (!con->txbuf->len)
+            console_tx_watch(con, false);
+    }
+    if (events & VIR_STREAM_EVENT_READABLE) {
+        /*
+         * Drain whatever is available into the receive buffer, then
+         * hand it to the owner in one go.  Stop when the buffer is
+         * full, the stream will signal readable again on the next
+         * main loop iteration if more data is pending.
+         */
+        con->rx_wakeups++;
+        while (len < con->rxbuf_size) {
+            rc = virStreamRecv(stream, con->rxbuf + len,
+                               con->rxbuf_size - len);
+            if (rc <= 0)
+                break;
+            len += rc;
+            con->rx_chunks++;
+        }
+        con->rx_bytes += len;
+        if (len)
+            con->ops->data(con->opaque, con->rxbuf, len);
+        if (!con->stream) {
+            /* closed by data callback */
+            return;
+        }
+        if (rc == 0 || rc == -1) {
+            if (debug)
+                fprintf(stderr, "%s: %s %s\n", __func__, con->name,
+                        rc == 0 ? "eof" : "error");
+            console_gone(con);
+            return;
+        }
+    }
+    if (events & VIR_STREAM_EVENT_HANGUP) {
+        if (debug)
+            fprintf(stderr, "%s: %s hangup\n", __func__, con->name);
+        console_gone(con);
+    }
+}
+
+static void console_event(virStreamPtr stream, int events, void *opaque)
+{
+    struct console_link *link = opaque;
+
+    /* console_close() from the callback may drop the other references */
+    console_link_ref(link);
+    g_rec_mutex_lock(&link->lock);
+    if (link->con && !link->con->dead)
+        console_event_locked(link->con, stream, events);
+    g_rec_mutex_unlock(&link->lock);
+    console_link_unref(link);
+}
+
+int console_open(struct console *con, virConnectPtr c, virDomainPtr d,
+                 bool force)
+{
+    int flags = 0;
+    int rc;
+
+    if (con->stream)
+        return 0;
+
+    con->stream = virStreamNew(c, VIR_STREAM_NONBLOCK);
+    if (!con->stream)
+        return -1;
+    if (force)
+        flags |= VIR_DOMAIN_CONSOLE_FORCE;
+    rc = virDomainOpenConsole(d, NULL, con->stream, flags);
+    if (rc < 0) {
+        if (debug)
+            fprintf(stderr, "%s: %s failed\n", __func__, con->name);
+        virStreamFree(con->stream);
+        con->stream = NULL;
+        return -1;
+    }
+
+    con->link = g_new0(struct console_link, 1);
+    g_rec_mutex_init(&con->link->lock);
+    con->link->con = con;
+    con->link->refcount = 2;
+    con->dead = false;
+    if (virStreamEventAddCallback(con->stream,
+                                  VIR_STREAM_EVENT_READABLE |
+                                  VIR_STREAM_EVENT_HANGUP,
+                                  console_event, con->link,
+                                  console_link_unref) < 0)
+        console_link_unref(con->link);
+    if (debug)
+        fprintf(stderr, "%s: %s ok\n", __func__, con->name);
+    return 0;
+}
+
+void console_close(struct console *con)
+{
+    struct console_link *link = con->link;
+
+    if (!con->stream)
+        return;
+
+    if (debug)
+        fprintf(stderr, "%s: %s\n", __func__, con->name);
+    g_rec_mutex_lock(&link->lock);
+    link->con = NULL;
+    g_rec_mutex_unlock(&link->lock);
+    virStreamEventRemoveCallback(con->stream);
+    virStreamFree(con->stream);
+    con->stream = NULL;
+    con->link = NULL;
+    console_link_unref(link);
+    if (con->txbuf) {
+        con->tx_dropped += con->txbuf->len;
+        g_byte_array_free(con->txbuf, TRUE);
+        con->txbuf = NULL;
+    }
+}
+
+static int console_send_locked(struct console *con, const char *buf, int len)
+{
+    bool idle;
+    int space;
+
+    if (!con->txbuf)
+        con->txbuf = g_byte_array_new();
+
+    idle = !con->txbuf->len;
+    space = CONSOLE_TXBUF_LIMIT - con->txbuf->len;
+    if (len > space) {
+        if (debug)
+            fprintf(stderr, "%s: %s: queue full, %d bytes dropped\n",
+                    __func__, con->name, len - space);
+        con->tx_dropped += len - space;
+        len = space;
+    }
+    g_byte_array_append(con->txbuf, (const guint8 *)buf, len);
+    con->tx_queued += len;
+
+    if (!idle)
+        return 0; /* writable event pending already */
+    if (console_tx_drain(con) < 0) {
+        /* no watch armed, don't leave data behind blocking later sends */
+        con->tx_dropped += con->txbuf->len;
+        g_byte_array_set_size(con->txbuf, 0);
+        return -1;
+    }
+    if (con->txbuf->len)
+        console_tx_watch(con, true);
+    return 0;
+}
+
+/*
+ * Queue input for the guest.  The stream is non-blocking, whatever it
+ * doesn't take right away is sent from the writable event handler, in
+ * order.  Input beyond CONSOLE_TXBUF_LIMIT is dropped.
+ */
+int console_send(struct console *con, const char *buf, int len)
+{
+    int rc;
+
+    if (!con->stream)
+        return -1;
+    g_rec_mutex_lock(&con->link->lock);
+    rc = con->dead ? -1 : console_send_locked(con, buf, len);
+    g_rec_mutex_unlock(&con->link->lock);
+    return rc;
+}
+
+/* ------------------------------------------------------------------ */
+
+static void console_ring_copy(void *opaque, const char *buf, size_t len)
+{
+    struct console_ring *ring = opaque;
+
+    console_ring_write(ring, buf, len);
+}
+
+void console_ring_resize(struct console_ring *ring, size_t size)
+{
+    struct console_ring old = *ring;
+
+    if (size == ring->size)
+        return;
+
+    /* keep the most recent data */
+    ring->buf = size ? g_malloc(size) : NULL;
+    ring->size = size;
+    ring->head = 0;
+    ring->fill = 0;
+    if (size)
+        console_ring_foreach(&old, console_ring_copy, ring);
+    g_free(old.buf);
+}
+
+void console_ring_write(struct console_ring *ring, const char *buf, size_t len)
+{
+    size_t first;
+
+    if (!ring->size)
+        return;
+    if (len >= ring->size) {
+        memcpy(ring->buf, buf + len - ring->size, ring->size);
+        ring->head = 0;
+        ring->fill = ring->size;
+        return;
+    }
+
+    first = MIN(len, ring->size - ring->head);
+    memcpy(ring->buf + ring->head, buf, first);
+    memcpy(ring->buf, buf + first, len - first);
+    ring->head = (ring->head + len) % ring->size;
+    ring->fill = MIN(ring->fill + len, ring->size);
+}
+
+void console_ring_foreach(struct console_ring *ring, console_ring_fn fn,
+                          void *opaque)
+{
+    size_t start, first;
+
+    if (!ring->fill)
+        return;
+    start = (ring->head + ring->size - ring->fill) % ring->size;
+    first = MIN(ring->fill, ring->size - start);
+    fn(opaque, ring->buf + start, first);
+    if (ring->fill > first)
+        fn(opaque, ring->buf, ring->fill - first);
+}
+
+/* ------------------------------------------------------------------ */
+
+void console_spsc_init(struct console_spsc *q, guint size)
+{
+    g_assert((size & (size - 1)) == 0);
+    q->buf = g_malloc(size);
+    q->size = size;
+    q->head = 0;
+    q->tail = 0;
+    q->dropped = 0;
+    q->dropped_seen = 0;
+}
+
+void console_spsc_free(struct console_spsc *q)
+{
+    g_free(q->buf);
+    q->buf = NULL;
+    q->size = 0;
+}
+
+/* producer side, returns the number of bytes queued */
+size_t console_spsc_write(struct console_spsc *q, const char *buf, size_t len)
+{
+    guint head = g_atomic_int_get(&q->head);
+    guint tail = g_atomic_int_get(&q->tail);
+    guint space = q->size - (head - tail);
+    guint pos, first;
+
+    if (len > space) {
+        g_atomic_int_add(&q->dropped, len - space);
+        len = space;
+    }
+    pos = head & (q->size - 1);
+    first = MIN(len, q->size - pos);
+    memcpy(q->buf + pos, buf, first);
+    memcpy(q->buf, buf + first, len - first);
+    /* publish data before moving head */
+    g_atomic_int_set(&q->head, head + len);
+    return len;
+}
+
+/* consumer side, passes everything queued to fn */
+size_t console_spsc_read(struct console_spsc *q, console_ring_fn fn,
+                         void *opaque)
+{
+    guint head = g_atomic_int_get(&q->head);
+    guint tail = g_atomic_int_get(&q->tail);
+    guint len = head - tail;
+    guint pos, first;
+
+    if (!len)
+        return 0;
+    pos = tail & (q->size - 1);
+    first = MIN(len, q->size - pos);
+    fn(opaque, q->buf + pos, first);
+    if (len > first)
+        fn(opaque, q->buf, len - first);
+    /* release space only after the data is consumed */
+    g_atomic_int_set(&q->tail, head);
+    return len;
+}
+
+/* consumer side, bytes dropped since the last call */
+guint console_spsc_dropped(struct console_spsc *q)
+{
+    guint dropped = g_atomic_int_get(&q->dropped);
+    guint delta = dropped - q->dropped_seen;
+
+    q->dropped_seen = dropped;
+    return delta;
+}
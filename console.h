@@ -0,0 +1,103 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <glib.h>
+
+#include <libvirt/libvirt.h>
+
+/*
+ * Guest serial console stream, no gtk dependencies so it can be shared
+ * between vconsole and vlogd.  Received data is passed to the data
+ * callback, when the stream is gone (eof, error, hangup) the hangup
+ * callback is called.  The console is closed already at that point,
+ * unless defer_close is set, then it is only marked dead and the owner
+ * must call console_close() itself.  Sending never blocks, input is
+ * queued until the stream takes it.
+ *
+ * Callbacks run on whatever thread runs the libvirt event loop.  Close
+ * and send are safe against callbacks running in another thread.
+ */
+
+#define CONSOLE_RXBUF_SIZE (64 * 1024)
+#define CONSOLE_TXBUF_LIMIT (1024 * 1024)
+
+struct console_link;
+
+struct console_ops {
+    void (*data)(void *opaque, const char *buf, int len);
+    void (*hangup)(void *opaque);
+};
+
+struct console {
+    const char                *name;     /* for debug logging */
+    const struct console_ops  *ops;
+    void                      *opaque;
+    virStreamPtr              stream;
+
+    /* set by owner, can be shared by consoles on the same main loop */
+    char                      *rxbuf;
+    int                       rxbuf_size;
+
+    /* receive statistics */
+    uint64_t                  rx_bytes;
+    uint64_t                  rx_chunks;
+    uint64_t                  rx_wakeups;
+
+    /* input waiting for the stream to become writable */
+    GByteArray                *txbuf;
+    uint64_t                  tx_queued;
+    uint64_t                  tx_sent;
+    uint64_t                  tx_dropped;
+
+    /* set by owner when callbacks run in another thread */
+    bool                      defer_close;
+    bool                      dead;      /* stream gone, not closed yet */
+    struct console_link       *link;     /* shared with stream callback */
+};
+
+int console_open(struct console *con, virConnectPtr c, virDomainPtr d,
+                 bool force);
+void console_close(struct console *con);
+int console_send(struct console *con, const char *buf, int len);
+
+/* ------------------------------------------------------------------ */
+
+/* keeps the most recent console output, size 0 means no buffer */
+struct console_ring {
+    char                      *buf;
+    size_t                    size;
+    size_t                    head;      /* next write position */
+    size_t                    fill;
+};
+
+typedef void (*console_ring_fn)(void *opaque, const char *buf, size_t len);
+
+void console_ring_resize(struct console_ring *ring, size_t size);
+void console_ring_write(struct console_ring *ring, const char *buf, size_t len);
+void console_ring_foreach(struct console_ring *ring, console_ring_fn fn,
+                          void *opaque);
+
+/* ------------------------------------------------------------------ */
+
+/*
+ * Single producer, single consumer byte queue, for handing console
+ * data from the event thread to the gtk thread without locking.  Size
+ * must be a power of two.  When full the producer drops data and
+ * counts it, the consumer picks up the count with console_spsc_dropped().
+ */
+struct console_spsc {
+    char                      *buf;
+    guint                     size;
+    gint                      head;      /* written by producer */
+    gint                      tail;      /* written by consumer */
+    gint                      dropped;   /* written by producer */
+    guint                     dropped_seen;
+};
+
+void console_spsc_init(struct console_spsc *q, guint size);
+void console_spsc_free(struct console_spsc *q);
+size_t console_spsc_write(struct console_spsc *q, const char *buf, size_t len);
+size_t console_spsc_read(struct console_spsc *q, console_ring_fn fn,
+                         void *opaque);
+guint console_spsc_dropped(struct console_spsc *q);
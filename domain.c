@@ -18,22 +18,83 @@ static const char *state_name[] = {
     [ VIR_DOMAIN_PMSUSPENDED ] = "suspended",
 };
 
-static const char *domain_state_name(struct vconsole_domain *dom)
+static const char *action_name[] = {
+    [ DOMAIN_ACTION_START ]    = "start",
+    [ DOMAIN_ACTION_PAUSE ]    = "pause",
+    [ DOMAIN_ACTION_SAVE ]     = "save",
+    [ DOMAIN_ACTION_REBOOT ]   = "reboot",
+    [ DOMAIN_ACTION_SHUTDOWN ] = "shutdown",
+    [ DOMAIN_ACTION_RESET ]    = "reset",
+    [ DOMAIN_ACTION_KILL ]     = "kill",
+    [ DOMAIN_ACTION_UNDEFINE ] = "undefine",
+};
+
+static const char *domain_state_str(int state)
 {
-    if (dom->info.state < sizeof(state_name)/sizeof(state_name[0]))
-        return state_name[dom->info.state];
+    if (state >= 0 && state < sizeof(state_name)/sizeof(state_name[0]))
+        return state_name[state];
     return "-?-";
 }
 
+static const char *domain_state_name(struct vconsole_domain *dom)
+{
+    return domain_state_str(dom->info.state);
+}
+
 static void domain_update_status(struct vconsole_domain *dom)
 {
-    char *line;
+    char *line, rx[64] = "", tx[64] = "", sb[64] = "", sf[128] = "";
+    char act[160] = "";
+    struct domain_sendfile *send = dom->sendfile;
+    gint64 elapsed;
+    GtkAdjustment *adj;
+    glong used, cols;
 
     if (!dom->status)
         return;
-    line = g_strdup_printf("%s%s%s%s%s", domain_state_name(dom),
+    if (dom->console.stream)
+        snprintf(rx, sizeof(rx), ", rx %.1f kB/s, %u.%u chunks/wakeup",
+                 dom->rx_rate / 1024.0,
+                 dom->rx_chunks_per_wakeup / 10,
+                 dom->rx_chunks_per_wakeup % 10);
+    if (dom->console.txbuf && dom->console.txbuf->len)
+        snprintf(tx, sizeof(tx), ", tx %.1f kB queued",
+                 dom->console.txbuf->len / 1024.0);
+    if (dom->console.tx_dropped)
+        snprintf(tx + strlen(tx), sizeof(tx) - strlen(tx),
+                 ", tx %" PRIu64 " bytes dropped", dom->console.tx_dropped);
+    if (send) {
+        elapsed = g_get_monotonic_time() - send->start;
+        snprintf(sf, sizeof(sf), ", sending %s %d%% (%.1f kB/s)",
+                 send->filename,
+                 send->size ? (int)(send->sent * 100 / send->size) : 0,
+                 elapsed ? send->sent * 1000000.0 / elapsed / 1024 : 0);
+    }
+    if (dom->action && g_atomic_int_get(&dom->action->progress) >= 0)
+        snprintf(act, sizeof(act), ", %s %d%%",
+                 action_name[dom->action->type],
+                 g_atomic_int_get(&dom->action->progress));
+    else if (dom->action)
+        snprintf(act, sizeof(act), ", %s %s",
+                 action_name[dom->action->type],
+                 g_atomic_int_get(&dom->action->running)
+                 ? "running" : "queued");
+    else if (dom->action_result)
+        snprintf(act, sizeof(act), ", %s", dom->action_result);
+    if (dom->vte && dom->scrollback) {
+        /* vte doesn't report memory, estimate from lines * columns */
+        adj = gtk_scrollable_get_vadjustment(GTK_SCROLLABLE(dom->vte));
+        cols = vte_terminal_get_column_count(VTE_TERMINAL(dom->vte));
+        used = gtk_adjustment_get_upper(adj) -
+            vte_terminal_get_row_count(VTE_TERMINAL(dom->vte));
+        used = MAX(used, 0);
+        snprintf(sb, sizeof(sb), ", scrollback %ld/%ld (~%ld kB)",
+                 used, dom->scrollback, used * cols / 1024);
+    }
+    line = g_strdup_printf("%s%s%s%s%s%s%s%s%s%s", domain_state_name(dom),
                            dom->saved   ? ", saved"     : "",
-                           dom->stream  ? ", connected" : "",
+                           dom->console.stream ? ", connected" : "",
+                           act, rx, tx, sf, sb,
                            dom->logname ? ", log "      : "",
                            dom->logname ? dom->logname  : "");
     gtk_label_set_text(GTK_LABEL(dom->status), line);
@@ -45,25 +106,18 @@ static void domain_update_status(struct vconsole_domain *dom)
 static void domain_foreach(struct vconsole_window *win,
                            void (*func)(struct vconsole_domain *dom))
 {
-    GtkTreeModel *model = GTK_TREE_MODEL(win->store);
-    GtkTreeIter host, guest;
+    struct vconsole_connect *conn;
     struct vconsole_domain *dom;
-    int rc;
+    GHashTableIter hosts, guests;
 
-    if (model == NULL)
+    if (win->hosts == NULL)
         return;
 
-    rc = gtk_tree_model_get_iter_first(model, &host);
-    while (rc) {
-        rc = gtk_tree_model_iter_nth_child(model, &guest, &host, 0);
-        while (rc) {
-            gtk_tree_model_get(model, &guest,
-                               DPTR_COL, &dom,
-                               -1);
+    g_hash_table_iter_init(&hosts, win->hosts);
+    while (g_hash_table_iter_next(&hosts, (gpointer *)&conn, NULL)) {
+        g_hash_table_iter_init(&guests, conn->domains);
+        while (g_hash_table_iter_next(&guests, NULL, (gpointer *)&dom))
             func(dom);
-            rc = gtk_tree_model_iter_next(model, &guest);
-        }
-        rc = gtk_tree_model_iter_next(model, &host);
     }
 }
 
@@ -90,74 +144,157 @@ static void domain_configure_vte(struct vconsole_domain *dom)
     vte_terminal_set_font(vte, font);
 }
 
-static void make_dirs(const char *filename)
+static char *domain_log_basename(struct vconsole_domain *dom,
+                                 const char *suffix)
 {
-    char *dirname = g_strdup(filename);
-    char *slash = strrchr(dirname, '/');
-
-    if (!slash)
-        return;
-    if (slash == dirname)
-        return;
-    *slash = 0;
-    if (mkdir(dirname, 0777) < 0) {
-        if (errno != ENOENT)
-            goto err;
-        make_dirs(dirname);
-        if (mkdir(dirname, 0777) < 0)
-            goto err;
-    }
-    return;
+    char *hostname, *basename;
 
-err:
-    fprintf(stderr, "mkdir %s: %s\n", dirname, strerror(errno));
-    g_free(dirname);
-    return;
+    hostname = virConnectGetHostname(dom->conn->ptr);
+    basename = g_strdup_printf("%s/vconsole/%s/%s%s",
+                               getenv("HOME"), hostname, dom->name, suffix);
+    free(hostname);
+    return basename;
 }
 
 static void domain_log_open(struct vconsole_domain *dom)
 {
+    static const char opened[] = "*** vconsole: log opened ***\n";
+    char *basename;
+
     if (!dom->conn->win->vm_logging)
         return;
-    if (!dom->stream)
+    if (!dom->console.stream)
         return;
-    if (dom->logfp)
+    if (dom->log)
         return;
 
-    dom->logname = g_strdup_printf("%s/vconsole/%s/%s.log",
-                                   getenv("HOME"),
-                                   virConnectGetHostname(dom->conn->ptr),
-                                   dom->name);
-    dom->logfp = fopen(dom->logname, "a");
-    if (dom->logfp == NULL) {
-        if (errno != ENOENT)
-            goto err;
-        make_dirs(dom->logname);
-        dom->logfp = fopen(dom->logname, "a");
-        if (dom->logfp == NULL)
-            goto err;
-    }
-    setbuf(dom->logfp, NULL);  /* unbuffered please */
-    fprintf(dom->logfp, "*** vconsole: log opened ***\n");
-    return;
-
-err:
-    fprintf(stderr, "open %s: %s\n", dom->logname, strerror(errno));
-    g_free(dom->logname);
-    dom->logname = NULL;
+    basename = domain_log_basename(dom, "");
+    dom->log = logwriter_open(basename);
+    dom->logname = g_strdup(logwriter_filename(dom->log));
+    g_free(basename);
+    logwriter_write(dom->log, opened, sizeof(opened) - 1);
 }
 
 static void domain_log_close(struct vconsole_domain *dom)
 {
-    if (!dom->logfp)
+    static const char closing[] = "\n*** vconsole: closing log ***\n";
+
+    if (!dom->log)
         return;
-    fprintf(dom->logfp, "\n*** vconsole: closing log ***\n");
-    fclose(dom->logfp);
-    dom->logfp = NULL;
+    logwriter_write(dom->log, closing, sizeof(closing) - 1);
+    logwriter_close(dom->log);
+    dom->log = NULL;
     g_free(dom->logname);
     dom->logname = NULL;
 }
 
+/* ------------------------------------------------------------------ */
+
+/*
+ * The budget is split evenly and is a hard limit, with many guests the
+ * rings get small.  New rings get their share right away, resizing the
+ * others happens once per batch from an idle callback, so attaching
+ * many guests doesn't resize all rings for each one.
+ */
+static size_t domain_history_share(struct vconsole_window *win)
+{
+    size_t size;
+
+    size = win->history_budget / MAX(win->history_rings, 1);
+    size = MIN(size, win->history_size);
+    if (size > 1024)
+        size &= ~((size_t)1024 - 1);
+    return MAX(size, 1);
+}
+
+static void domain_history_resize(struct vconsole_domain *dom)
+{
+    if (!dom->history.size)
+        return;
+    console_ring_resize(&dom->history, domain_history_share(dom->conn->win));
+}
+
+static gboolean domain_history_rebalance(gpointer opaque)
+{
+    struct vconsole_window *win = opaque;
+
+    win->history_rebalance = 0;
+    if (debug)
+        fprintf(stderr, "%s: %d rings, %zu bytes each\n", __func__,
+                win->history_rings, domain_history_share(win));
+    domain_foreach(win, domain_history_resize);
+    return FALSE;
+}
+
+static void domain_history_changed(struct vconsole_window *win)
+{
+    if (!win->history_rebalance)
+        win->history_rebalance = g_idle_add(domain_history_rebalance, win);
+}
+
+static void domain_history_alloc(struct vconsole_domain *dom)
+{
+    struct vconsole_window *win = dom->conn->win;
+
+    if (!win->vm_history || dom->history.size)
+        return;
+    win->history_rings++;
+    console_ring_resize(&dom->history, domain_history_share(win));
+    domain_history_changed(win);
+}
+
+static void domain_history_free(struct vconsole_domain *dom)
+{
+    struct vconsole_window *win = dom->conn->win;
+
+    if (!dom->history.size)
+        return;
+    win->history_rings--;
+    console_ring_resize(&dom->history, 0);
+    /* hand the share back to the others */
+    domain_history_changed(win);
+}
+
+static void domain_history_write(void *opaque, const char *buf, size_t len)
+{
+    struct logwriter *lw = opaque;
+
+    logwriter_write(lw, buf, len);
+}
+
+static void domain_history_dump(struct vconsole_domain *dom)
+{
+    GDateTime *now;
+    struct logwriter *lw;
+    char *stamp, *suffix, *basename;
+
+    if (!dom->history.fill)
+        return;
+
+    now = g_date_time_new_now_local();
+    stamp = g_date_time_format(now, "%Y%m%d-%H%M%S");
+    suffix = g_strdup_printf(".crash-%s", stamp);
+    basename = domain_log_basename(dom, suffix);
+    lw = logwriter_open(basename);
+    console_ring_foreach(&dom->history, domain_history_write, lw);
+    if (debug)
+        fprintf(stderr, "%s: %s\n", __func__, logwriter_filename(lw));
+    logwriter_close(lw);
+    g_free(basename);
+    g_free(suffix);
+    g_free(stamp);
+    g_date_time_unref(now);
+}
+
+static void domain_history_feed(void *opaque, const char *buf, size_t len)
+{
+    struct vconsole_domain *dom = opaque;
+
+    vte_terminal_feed(VTE_TERMINAL(dom->vte), buf, len);
+}
+
+/* ------------------------------------------------------------------ */
+
 static void domain_configure_logging(struct vconsole_domain *dom)
 {
     gboolean logging = dom->conn->win->vm_logging;
@@ -179,112 +316,523 @@ void domain_configure_all_logging(struct vconsole_window *win)
     domain_foreach(win, domain_configure_logging);
 }
 
-static void domain_disconnect(struct vconsole_domain *dom, virDomainPtr d)
+static void domain_disconnect(struct vconsole_domain *dom)
 {
-    if (!dom->stream)
+    if (!dom->console.stream)
         return;
 
-    if (debug)
-        fprintf(stderr, "%s: %s\n", __func__, dom->name);
-    virStreamEventRemoveCallback(dom->stream);
-    virStreamFree(dom->stream);
-    dom->stream = NULL;
+    console_close(&dom->console);
     domain_log_close(dom);
     domain_update_status(dom);
 }
 
-static void domain_close_tab(struct vconsole_domain *dom, virDomainPtr d)
+static void domain_close_tab(struct vconsole_domain *dom)
 {
     GtkNotebook *notebook = GTK_NOTEBOOK(dom->conn->win->notebook);
     gint page;
 
-    domain_disconnect(dom, d);
+    /* keep collecting history in the background */
+    if (!dom->history.size)
+        domain_disconnect(dom);
     if (!dom->vbox)
         return;
     page = gtk_notebook_page_num(notebook, dom->vbox);
     gtk_notebook_remove_page(notebook, page);
+    console_ring_resize(&dom->deferred, 0);
+    dom->deferred_bytes = 0;
+    dom->scrollback = 0;
     dom->vbox = NULL;
     dom->vte = NULL;
     dom->status = NULL;
 }
 
-static void domain_console_event(virStreamPtr stream, int events, void *opaque)
+static gboolean domain_visible(struct vconsole_domain *dom)
+{
+    GtkNotebook *notebook = GTK_NOTEBOOK(dom->conn->win->notebook);
+
+    if (!dom->vte)
+        return FALSE;
+    if (dom->window)
+        return !dom->iconified;
+    if (dom->conn->win->iconified)
+        return FALSE;
+    return gtk_notebook_get_nth_page
+        (notebook, gtk_notebook_get_current_page(notebook)) == dom->vbox;
+}
+
+/* ------------------------------------------------------------------ */
+
+/*
+ * Split the scrollback budget (in lines) across all terminals.  Each
+ * terminal gets a floor of SCROLLBACK_MIN lines (less if there are too
+ * many terminals for that), the rest is split by weight: the visible
+ * terminal gets the largest share, terminals with console traffic more
+ * than idle ones.  The shares add up to the budget.
+ */
+#define SCROLLBACK_MIN          1000
+#define SCROLLBACK_BUSY_RATE    64    /* bytes/s */
+
+static glong scrollback_weights;
+static glong scrollback_terminals;
+
+static int domain_scrollback_weight(struct vconsole_domain *dom)
+{
+    if (domain_visible(dom))
+        return 4;
+    if (dom->rx_rate >= SCROLLBACK_BUSY_RATE)
+        return 2;
+    return 1;
+}
+
+static void domain_scrollback_sum(struct vconsole_domain *dom)
+{
+    if (!dom->vte)
+        return;
+    scrollback_weights += domain_scrollback_weight(dom);
+    scrollback_terminals++;
+}
+
+static void domain_scrollback_apply(struct vconsole_domain *dom)
+{
+    struct vconsole_window *win = dom->conn->win;
+    glong floor, lines;
+
+    if (!dom->vte)
+        return;
+    floor = MIN(SCROLLBACK_MIN, win->tty_scrollback / scrollback_terminals);
+    lines = floor + (win->tty_scrollback - floor * scrollback_terminals)
+        * domain_scrollback_weight(dom) / scrollback_weights;
+
+    /* avoid reflowing for small growth, shrinking keeps the budget */
+    if (lines > dom->scrollback &&
+        (lines - dom->scrollback) * 10 < dom->scrollback)
+        return;
+    if (debug > 1)
+        fprintf(stderr, "%s: %s: %ld -> %ld lines\n", __func__,
+                dom->name, dom->scrollback, lines);
+    vte_terminal_set_scrollback_lines(VTE_TERMINAL(dom->vte), lines);
+    dom->scrollback = lines;
+    domain_update_status(dom);
+}
+
+void domain_scrollback_rebalance(struct vconsole_window *win)
+{
+    scrollback_weights = 0;
+    scrollback_terminals = 0;
+    domain_foreach(win, domain_scrollback_sum);
+    if (scrollback_weights)
+        domain_foreach(win, domain_scrollback_apply);
+}
+
+/* ------------------------------------------------------------------ */
+
+static void domain_defer(struct vconsole_domain *dom,
+                         const char *buf, int len)
+{
+    if (!dom->deferred.size)
+        console_ring_resize(&dom->deferred, dom->conn->win->tty_defer_limit);
+    console_ring_write(&dom->deferred, buf, len);
+    dom->deferred_bytes += len;
+}
+
+static void domain_deferred_append(void *opaque, const char *buf, size_t len)
+{
+    GString *str = opaque;
+
+    g_string_append_len(str, buf, len);
+}
+
+void domain_flush_deferred(struct vconsole_domain *dom)
+{
+    size_t skipped = dom->deferred_bytes - dom->deferred.fill;
+    GString *str;
+
+    if (!dom->deferred_bytes)
+        return;
+
+    str = g_string_sized_new(dom->deferred.fill + 64);
+    if (skipped)
+        g_string_printf(str, "\r\n*** vconsole: skipped %zu bytes ***\r\n",
+                        skipped);
+    console_ring_foreach(&dom->deferred, domain_deferred_append, str);
+    if (dom->vte)
+        vte_terminal_feed(VTE_TERMINAL(dom->vte), str->str, str->len);
+    g_string_free(str, TRUE);
+
+    console_ring_resize(&dom->deferred, 0);
+    dom->deferred_bytes = 0;
+}
+
+/* ------------------------------------------------------------------ */
+
+/*
+ * Send a file to the guest console.  Runs from a timer on the main
+ * loop.  Each tick sends blocks as long as the console tx queue has
+ * room (and for at most half a tick), so large files don't block the
+ * ui.  The file is opened non-blocking, a fifo without data just waits
+ * for the next tick.  Pacing options: a byte rate limit, a delay after
+ * each line, or waiting for the guest to echo each line (with a
+ * timeout so a quiet guest can't stall it).
+ */
+#define SENDFILE_TICK           20    /* ms */
+#define SENDFILE_QUEUE          (64 * 1024)
+#define SENDFILE_ECHO_TIMEOUT   2000  /* ms */
+#define SENDFILE_STATUS         500   /* ms */
+
+static void domain_sendfile_finish(struct vconsole_domain *dom,
+                                   const char *result)
+{
+    struct domain_sendfile *send = dom->sendfile;
+    char *msg;
+
+    msg = g_strdup_printf("\r\n*** vconsole: %s: %s, %" G_GINT64_FORMAT
+                          " bytes sent ***\r\n", send->filename, result,
+                          (gint64)send->sent);
+    if (debug)
+        fprintf(stderr, "%s: %s: %s", __func__, dom->name, msg + 2);
+    if (dom->vte)
+        vte_terminal_feed(VTE_TERMINAL(dom->vte), msg, strlen(msg));
+    g_free(msg);
+
+    g_source_remove(send->timer);
+    close(send->fd);
+    g_free(send->filename);
+    g_free(send);
+    dom->sendfile = NULL;
+    domain_update_status(dom);
+}
+
+/* next chunk to send: everything buffered, or up to the next newline */
+static ssize_t domain_sendfile_chunk(struct domain_sendfile *send)
+{
+    bool lines = send->line_delay || send->echo;
+    char *nl = NULL;
+    ssize_t rc;
+
+    for (;;) {
+        if (lines)
+            nl = memchr(send->buf + send->pos, '\n', send->len - send->pos);
+        if (nl)
+            return nl + 1 - (send->buf + send->pos);
+        if (send->eof)
+            return send->len - send->pos;
+        if (!lines && send->pos < send->len)
+            return send->len - send->pos;
+        if (send->pos == 0 && send->len == sizeof(send->buf))
+            return send->len; /* overlong line */
+
+        memmove(send->buf, send->buf + send->pos, send->len - send->pos);
+        send->len -= send->pos;
+        send->pos = 0;
+        rc = read(send->fd, send->buf + send->len,
+                  sizeof(send->buf) - send->len);
+        if (rc < 0)
+            return -1;
+        if (rc == 0)
+            send->eof = TRUE;
+        send->len += rc;
+    }
+}
+
+static gboolean domain_sendfile_tick(gpointer opaque)
 {
     struct vconsole_domain *dom = opaque;
-    virDomainPtr d = virDomainLookupByUUIDString(dom->conn->ptr, dom->uuid);
-    char buf[128];
-    int rc, bytes = 0;
-
-    if (events & VIR_STREAM_EVENT_READABLE) {
-        for (;;) {
-            rc = virStreamRecv(stream, buf, sizeof(buf));
-            if (rc <= 0)
+    struct domain_sendfile *send = dom->sendfile;
+    GByteArray *txbuf;
+    gint64 now = g_get_monotonic_time();
+    gint64 budget;
+    ssize_t len;
+
+    if (!dom->console.stream) {
+        domain_sendfile_finish(dom, "console disconnected");
+        return G_SOURCE_REMOVE;
+    }
+    if (now < send->next)
+        return G_SOURCE_CONTINUE;
+    send->echo_wait = FALSE;
+
+    while (now >= send->next &&
+           g_get_monotonic_time() - now < SENDFILE_TICK * 1000 / 2) {
+        /* let the console tx queue drain first */
+        txbuf = dom->console.txbuf;
+        if (txbuf && txbuf->len >= SENDFILE_QUEUE)
+            break;
+
+        len = domain_sendfile_chunk(send);
+        if (len < 0 && errno == EAGAIN)
+            break;  /* fifo, no data yet */
+        if (len < 0) {
+            domain_sendfile_finish(dom, strerror(errno));
+            return G_SOURCE_REMOVE;
+        }
+        if (len == 0) {
+            domain_sendfile_finish(dom, "done");
+            return G_SOURCE_REMOVE;
+        }
+        if (send->rate) {
+            budget = send->rate * (now - send->start) / 1000000 - send->sent;
+            if (budget <= 0)
                 break;
-            bytes += rc;
-            if (dom->vte)
-                vte_terminal_feed(VTE_TERMINAL(dom->vte), buf, rc);
-            if (dom->logfp)
-                fwrite(buf, rc, 1, dom->logfp);
+            len = MIN(len, budget);
         }
-        if (bytes == 0) {
-            if (debug)
-                fprintf(stderr, "%s: %s eof\n", __func__, dom->name);
-            domain_disconnect(dom, d);
+
+        if (console_send(&dom->console, send->buf + send->pos, len) < 0) {
+            domain_sendfile_finish(dom, "send error");
+            return G_SOURCE_REMOVE;
+        }
+        send->pos += len;
+        send->sent += len;
+
+        if (send->buf[send->pos - 1] == '\n') {
+            if (send->echo) {
+                send->echo_wait = TRUE;
+                send->next = now + SENDFILE_ECHO_TIMEOUT * 1000;
+            } else if (send->line_delay) {
+                send->next = now + send->line_delay * 1000;
+            }
         }
     }
-    if (events & VIR_STREAM_EVENT_HANGUP) {
-        if (debug)
-            fprintf(stderr, "%s: %s hangup\n", __func__, dom->name);
-        domain_disconnect(dom, d);
+    if (now - send->status >= SENDFILE_STATUS * 1000) {
+        send->status = now;
+        domain_update_status(dom);
     }
-    virDomainFree(d);
+    return G_SOURCE_CONTINUE;
 }
 
+int domain_sendfile_start(struct vconsole_domain *dom, const char *filename,
+                          unsigned int rate, unsigned int line_delay,
+                          gboolean echo)
+{
+    struct domain_sendfile *send;
+    struct stat st;
+    int fd;
+
+    if (dom->sendfile || !dom->console.stream)
+        return -1;
+    fd = open(filename, O_RDONLY | O_NONBLOCK);
+    if (fd < 0)
+        return -1;
+    fstat(fd, &st);
+
+    send = g_new0(struct domain_sendfile, 1);
+    send->filename = g_path_get_basename(filename);
+    send->fd = fd;
+    send->size = st.st_size;
+    send->rate = rate;
+    send->line_delay = line_delay;
+    send->echo = echo;
+    send->start = g_get_monotonic_time();
+    send->timer = g_timeout_add(SENDFILE_TICK, domain_sendfile_tick, dom);
+    dom->sendfile = send;
+    if (debug)
+        fprintf(stderr, "%s: %s: %s, %" G_GINT64_FORMAT " bytes\n",
+                __func__, dom->name, filename, (gint64)send->size);
+    domain_update_status(dom);
+    return 0;
+}
+
+void domain_sendfile_cancel(struct vconsole_domain *dom)
+{
+    if (dom->sendfile)
+        domain_sendfile_finish(dom, "cancelled");
+}
+
+/* ------------------------------------------------------------------ */
+
+static void domain_console_data(void *opaque, const char *buf, int len)
+{
+    struct vconsole_domain *dom = opaque;
+
+    if (dom->sendfile && dom->sendfile->echo_wait &&
+        memchr(buf, '\n', len)) {
+        /* guest echoed the line, go on with the next one */
+        dom->sendfile->echo_wait = FALSE;
+        dom->sendfile->next = 0;
+    }
+
+    if (dom->vte) {
+        if (!dom->conn->win->tty_defer || domain_visible(dom))
+            vte_terminal_feed(VTE_TERMINAL(dom->vte), buf, len);
+        else
+            domain_defer(dom, buf, len);
+    }
+    if (dom->log)
+        logwriter_write(dom->log, buf, len);
+    console_ring_write(&dom->history, buf, len);
+}
+
+static void domain_console_hangup(void *opaque)
+{
+    struct vconsole_domain *dom = opaque;
+
+    domain_log_close(dom);
+    domain_update_status(dom);
+}
+
+static const struct console_ops domain_console_ops = {
+    .data   = domain_console_data,
+    .hangup = domain_console_hangup,
+};
+
+/*
+ * With the libvirt event loop in its own thread the console callbacks
+ * run there.  They copy the data into the per-guest rxring and kick
+ * domain_flush_rings() on the gtk main loop, which does the actual
+ * work (terminal, log, history) for all guests in one go.  At most
+ * one flush is pending at any time, so a busy guest costs one wakeup
+ * of the gtk thread per main loop iteration, not one per chunk.
+ */
+
+#define DOMAIN_RXRING_SIZE (4 * CONSOLE_RXBUF_SIZE)
+
+static void domain_flush_ring_data(void *opaque, const char *buf, size_t len)
+{
+    domain_console_data(opaque, buf, len);
+}
+
+static void domain_flush_ring(struct vconsole_domain *dom)
+{
+    char msg[64];
+    gboolean hangup;
+    guint dropped;
+
+    if (!dom->rxring.size)
+        return;
+
+    /* check first, data queued before the hangup must be flushed */
+    hangup = g_atomic_int_get(&dom->rx_hangup);
+    console_spsc_read(&dom->rxring, domain_flush_ring_data, dom);
+    dropped = console_spsc_dropped(&dom->rxring);
+    if (dropped) {
+        snprintf(msg, sizeof(msg), "\r\n*** vconsole: %u bytes dropped ***\r\n",
+                 dropped);
+        if (dom->vte)
+            vte_terminal_feed(VTE_TERMINAL(dom->vte), msg, -1);
+    }
+    if (hangup) {
+        g_atomic_int_set(&dom->rx_hangup, 0);
+        console_close(&dom->console);
+        domain_console_hangup(dom);
+    }
+}
+
+static gboolean domain_flush_rings(gpointer opaque)
+{
+    struct vconsole_window *win = opaque;
+
+    g_atomic_int_set(&win->flush_pending, 0);
+    domain_foreach(win, domain_flush_ring);
+    return FALSE;
+}
+
+static void domain_flush_kick(struct vconsole_window *win)
+{
+    if (g_atomic_int_compare_and_exchange(&win->flush_pending, 0, 1))
+        g_idle_add(domain_flush_rings, win);
+}
+
+static void domain_console_data_thread(void *opaque, const char *buf, int len)
+{
+    struct vconsole_domain *dom = opaque;
+
+    console_spsc_write(&dom->rxring, buf, len);
+    domain_flush_kick(dom->conn->win);
+}
+
+static void domain_console_hangup_thread(void *opaque)
+{
+    struct vconsole_domain *dom = opaque;
+
+    g_atomic_int_set(&dom->rx_hangup, 1);
+    domain_flush_kick(dom->conn->win);
+}
+
+static const struct console_ops domain_console_thread_ops = {
+    .data   = domain_console_data_thread,
+    .hangup = domain_console_hangup_thread,
+};
+
 static void domain_user_input(VteTerminal *vte, gchar *buf, guint len,
                               gpointer opaque)
 {
     struct vconsole_domain *dom = opaque;
 
-    if (dom->stream) {
-        virStreamSend(dom->stream, buf, len);
+    if (dom->console.stream) {
+        console_send(&dom->console, buf, len);
         return;
     }
+    if (dom->action && dom->action->type == DOMAIN_ACTION_START)
+        return;  /* already on the way */
     domain_start(dom, false);
 }
 
-static void domain_connect(struct vconsole_domain *dom, virDomainPtr d)
+static void domain_connect(struct vconsole_domain *dom)
 {
-    int flags = 0;
-    int rc;
+    struct console *con = &dom->console;
 
-    if (dom->stream)
+    if (con->stream)
         return;
 
-    dom->stream = virStreamNew(dom->conn->ptr,
-                               VIR_STREAM_NONBLOCK);
-    if (dom->conn->cap_console_force)
-        flags |= VIR_DOMAIN_CONSOLE_FORCE;
-    rc = virDomainOpenConsole(d, NULL, dom->stream, flags);
-    if (rc < 0) {
-        if (debug)
-            fprintf(stderr, "%s: %s failed\n", __func__, dom->name);
-        virStreamFree(dom->stream);
-        dom->stream = NULL;
-        return;
+    if (!con->rxbuf) {
+        con->rxbuf = g_malloc(CONSOLE_RXBUF_SIZE);
+        con->rxbuf_size = CONSOLE_RXBUF_SIZE;
+        con->ops = &domain_console_ops;
+        con->opaque = dom;
+        if (dom->conn->win->event_thread) {
+            console_spsc_init(&dom->rxring, DOMAIN_RXRING_SIZE);
+            con->ops = &domain_console_thread_ops;
+            con->defer_close = true;
+        }
     }
+    g_atomic_int_set(&dom->rx_hangup, 0);
+    /* force only when the user asks for it by opening a tab */
+    if (console_open(con, dom->conn->ptr, dom->d,
+                     dom->vbox && dom->conn->cap_console_force) < 0)
+        return;
+    domain_history_alloc(dom);
 
-    virStreamEventAddCallback(dom->stream,
-                              VIR_STREAM_EVENT_READABLE |
-                              VIR_STREAM_EVENT_HANGUP,
-                              domain_console_event, dom, NULL);
-    if (debug)
-        fprintf(stderr, "%s: %s ok\n", __func__, dom->name);
     domain_log_open(dom);
     domain_update_status(dom);
 }
 
-static int domain_update_info(struct vconsole_domain *dom, virDomainPtr d)
+static void domain_set_info(struct vconsole_domain *dom,
+                            struct timeval *ts, virDomainInfo *info)
+{
+    dom->last_info = dom->info;
+    dom->last_ts   = dom->ts;
+    dom->ts        = *ts;
+    dom->info      = *info;
+
+    if (dom->last_ts.tv_sec) {
+        uint64_t real, cpu, wakeups;
+        real  = (dom->ts.tv_sec - dom->last_ts.tv_sec) * 1000000000;
+        real += (dom->ts.tv_usec - dom->last_ts.tv_usec) * 1000;
+        cpu   = dom->info.cpuTime - dom->last_info.cpuTime;
+        if (real) {
+            dom->load = cpu * 100 / real;
+            dom->rx_rate = (dom->console.rx_bytes - dom->rx_last_bytes)
+                * 1000000000 / real;
+        }
+        wakeups = dom->console.rx_wakeups - dom->rx_last_wakeups;
+        dom->rx_chunks_per_wakeup = wakeups
+            ? (dom->console.rx_chunks - dom->rx_last_chunks) * 10 / wakeups
+            : 0;
+        if (debug > 1 && wakeups)
+            fprintf(stderr, "%s: %s: rx %" PRIu64 " bytes/s, %u.%u chunks/wakeup\n",
+                    __func__, dom->name, dom->rx_rate,
+                    dom->rx_chunks_per_wakeup / 10,
+                    dom->rx_chunks_per_wakeup % 10);
+    }
+    dom->rx_last_bytes   = dom->console.rx_bytes;
+    dom->rx_last_chunks  = dom->console.rx_chunks;
+    dom->rx_last_wakeups = dom->console.rx_wakeups;
+
+    domain_update_status(dom);
+}
+
+static int domain_update_info(struct vconsole_domain *dom)
 {
+    virDomainPtr d = dom->d;
     struct timeval ts;
     const char *name;
     int id, rc;
@@ -303,34 +851,149 @@ static int domain_update_info(struct vconsole_domain *dom, virDomainPtr d)
 
     if (dom->name)
         g_free((gpointer)dom->name);
-    dom->last_info = dom->info;
-    dom->last_ts   = dom->ts;
-    dom->ts        = ts;
     dom->name      = g_strdup(name);
+    dom->console.name = dom->name;
     dom->id        = id;
     dom->saved     = saved;
-    dom->info      = info;
+    domain_set_info(dom, &ts, &info);
+    return 0;
+}
 
-    if (dom->last_ts.tv_sec) {
-        uint64_t real, cpu;
-        real  = (dom->ts.tv_sec - dom->last_ts.tv_sec) * 1000000000;
-        real += (dom->ts.tv_usec - dom->last_ts.tv_usec) * 1000;
-        cpu   = dom->info.cpuTime - dom->last_info.cpuTime;
-        dom->load = cpu * 100 / real;
+#if LIBVIR_VERSION_NUMBER >= 1002008 /* 1.2.8 */
+/*
+ * Fill in virDomainInfo fields from a stats record.  Doesn't touch
+ * any global state, so it can be called from worker threads.
+ */
+void domain_stats_info(virDomainStatsRecordPtr rec, virDomainInfo *info)
+{
+    unsigned long long ull;
+    unsigned int ui;
+    int state;
+
+    /* not reported for inactive guests -> keep or clear */
+    info->cpuTime = 0;
+    if (virTypedParamsGetInt(rec->params, rec->nparams,
+                             "state.state", &state) == 1)
+        info->state = state;
+    if (virTypedParamsGetULLong(rec->params, rec->nparams,
+                                "cpu.time", &ull) == 1)
+        info->cpuTime = ull;
+    if (virTypedParamsGetULLong(rec->params, rec->nparams,
+                                "balloon.current", &ull) == 1)
+        info->memory = ull;
+    if (virTypedParamsGetULLong(rec->params, rec->nparams,
+                                "balloon.maximum", &ull) == 1)
+        info->maxMem = ull;
+    if (virTypedParamsGetUInt(rec->params, rec->nparams,
+                              "vcpu.current", &ui) == 1)
+        info->nrVirtCpu = ui;
+}
+
+/*
+ * Fetch state, cpu time, memory and vcpu count for a list of domains
+ * of a connection with a single call.  Name and managed save state are
+ * not covered, they are refreshed by domain_update_info() when
+ * lifecycle events arrive.
+ */
+static int domain_update_stats(struct vconsole_connect *conn, GPtrArray *due)
+{
+    virDomainStatsRecordPtr *records = NULL;
+    virDomainStatsRecordPtr rec;
+    virDomainPtr *doms;
+    struct vconsole_domain *dom;
+    char uuid[VIR_UUID_STRING_BUFLEN];
+    struct timeval ts;
+    virDomainInfo info;
+    virErrorPtr err;
+    int i, n;
+
+    doms = g_new0(virDomainPtr, due->len + 1);
+    for (i = 0; i < due->len; i++)
+        doms[i] = ((struct vconsole_domain *)g_ptr_array_index(due, i))->d;
+    n = virDomainListGetStats(doms, DOMAIN_STATS, &records, 0);
+    g_free(doms);
+    if (n < 0) {
+        err = virGetLastError();
+        if (err && err->code == VIR_ERR_NO_SUPPORT) {
+            if (debug)
+                fprintf(stderr, "%s: not supported, using fallback\n",
+                        __func__);
+            conn->cap_bulk_stats = FALSE;
+        }
+        return -1;
     }
 
-    domain_update_status(dom);
+    gettimeofday(&ts, NULL);
+    for (i = 0; i < n; i++) {
+        rec = records[i];
+        virDomainGetUUIDString(rec->dom, uuid);
+        dom = g_hash_table_lookup(conn->domains, uuid);
+        if (!dom)
+            continue;
+
+        info = dom->info;
+        domain_stats_info(rec, &info);
+        dom->id = virDomainGetID(rec->dom);
+        domain_set_info(dom, &ts, &info);
+    }
+    virDomainStatsRecordListFree(records);
     return 0;
 }
+#else
+static int domain_update_stats(struct vconsole_connect *conn, GPtrArray *due)
+{
+    return -1;
+}
+#endif
+
+/*
+ * Only write columns which actually changed, each gtk_tree_store_set()
+ * call means row-changed, redraw and possibly re-sort.  The last values
+ * written are kept in dom->rowcache, compared as numbers so the column
+ * strings are only formatted when needed.  The sort functions use
+ * rowcache too, so it must be updated before the store.
+ */
+static unsigned long tree_updates_applied;
+static unsigned long tree_updates_skipped;
+
+static void domain_row_int(GValue *values, gint *cols, gint *n,
+                           gint col, int val)
+{
+    g_value_init(&values[*n], G_TYPE_INT);
+    g_value_set_int(&values[*n], val);
+    cols[(*n)++] = col;
+}
+
+static void domain_row_bool(GValue *values, gint *cols, gint *n,
+                            gint col, gboolean val)
+{
+    g_value_init(&values[*n], G_TYPE_BOOLEAN);
+    g_value_set_boolean(&values[*n], val);
+    cols[(*n)++] = col;
+}
+
+static void domain_row_string(GValue *values, gint *cols, gint *n,
+                              gint col, const char *val)
+{
+    g_value_init(&values[*n], G_TYPE_STRING);
+    g_value_set_string(&values[*n], val);
+    cols[(*n)++] = col;
+}
 
 static void domain_update_tree_store(struct vconsole_domain *dom,
                                      GtkTreeIter *guest)
 {
+    struct domain_row_cache *rc = &dom->rowcache;
     bool darkmode = dom->conn->win->darkmode;
+    bool running = dom->info.state == VIR_DOMAIN_RUNNING;
     const char *foreground;
     char load[20], mem[20];
     PangoWeight weight;
+    unsigned long memory;
     int avgload;
+    GValue values[N_COLUMNS] = {};
+    gint cols[N_COLUMNS];
+    gint i, n = 0;
 
     switch (dom->info.state) {
     case VIR_DOMAIN_RUNNING:
@@ -342,23 +1005,67 @@ static void domain_update_tree_store(struct vconsole_domain *dom,
         weight = PANGO_WEIGHT_NORMAL;
         break;
     }
-    snprintf(load, sizeof(load), "%d%%", dom->load);
-    snprintf(mem, sizeof(mem), "%ld M", dom->info.memory / 1024);
+    memory = dom->info.memory / 1024;
     avgload = dom->info.nrVirtCpu ? dom->load / dom->info.nrVirtCpu : 0;
+    avgload = MIN(avgload, 100);
+
+    if (!rc->valid || g_strcmp0(rc->name, dom->name) != 0) {
+        g_free(rc->name);
+        g_free(rc->sortkey);
+        rc->name = g_strdup(dom->name);
+        /* natural order, "vm9" before "vm10" */
+        rc->sortkey = g_utf8_collate_key_for_filename(dom->name ? dom->name
+                                                      : "", -1);
+        domain_row_string(values, cols, &n, NAME_COL, dom->name);
+    }
+    if (!rc->valid || rc->id != dom->id) {
+        rc->id = dom->id;
+        domain_row_int(values, cols, &n, ID_COL, dom->id);
+    }
+    if (!rc->valid || rc->state != dom->info.state) {
+        rc->state = dom->info.state;
+        domain_row_bool(values, cols, &n, IS_RUNNING_COL, running);
+        domain_row_bool(values, cols, &n, HAS_MEMCPU_COL, running);
+        domain_row_string(values, cols, &n, STATE_COL,
+                          domain_state_name(dom));
+    }
+    if (!rc->valid || rc->nr_cpus != dom->info.nrVirtCpu) {
+        rc->nr_cpus = dom->info.nrVirtCpu;
+        domain_row_int(values, cols, &n, NR_CPUS_COL, dom->info.nrVirtCpu);
+    }
+    if (!rc->valid || rc->load != dom->load) {
+        rc->load = dom->load;
+        snprintf(load, sizeof(load), "%d%%", dom->load);
+        domain_row_string(values, cols, &n, LOAD_STR_COL, load);
+    }
+    if (!rc->valid || rc->avgload != avgload) {
+        rc->avgload = avgload;
+        domain_row_int(values, cols, &n, LOAD_INT_COL, avgload);
+    }
+    if (!rc->valid || rc->memory != memory) {
+        rc->memory = memory;
+        snprintf(mem, sizeof(mem), "%ld M", memory);
+        domain_row_string(values, cols, &n, MEMORY_COL, mem);
+    }
+    if (!rc->valid || rc->foreground != foreground) {
+        rc->foreground = foreground;
+        domain_row_string(values, cols, &n, FOREGROUND_COL, foreground);
+    }
+    if (!rc->valid || rc->weight != weight) {
+        rc->weight = weight;
+        domain_row_int(values, cols, &n, WEIGHT_COL, weight);
+    }
+    rc->valid = TRUE;
 
-    gtk_tree_store_set(dom->conn->win->store, guest,
-                       NAME_COL,       dom->name,
-                       ID_COL,         dom->id,
-                       IS_RUNNING_COL, dom->info.state == VIR_DOMAIN_RUNNING,
-                       HAS_MEMCPU_COL, dom->info.state == VIR_DOMAIN_RUNNING,
-                       STATE_COL,      domain_state_name(dom),
-                       NR_CPUS_COL,    dom->info.nrVirtCpu,
-                       LOAD_STR_COL,   load,
-                       LOAD_INT_COL,   MIN(avgload, 100),
-                       MEMORY_COL,     mem,
-                       FOREGROUND_COL, foreground,
-                       WEIGHT_COL,     weight,
-                       -1);
+    if (!n) {
+        tree_updates_skipped++;
+        return;
+    }
+    tree_updates_applied++;
+    gtk_tree_store_set_valuesv(dom->conn->win->store, guest,
+                               cols, values, n);
+    for (i = 0; i < n; i++)
+        g_value_unset(&values[i]);
 }
 
 /* ------------------------------------------------------------------ */
@@ -410,9 +1117,22 @@ static gboolean domain_window_close(GtkWidget *widget, GdkEvent *event,
                                dom->vbox, lhbox);
     gtk_widget_destroy(dom->window);
     dom->window = NULL;
+    dom->iconified = FALSE;
     return TRUE;
 }
 
+static gboolean domain_window_state(GtkWidget *widget,
+                                    GdkEventWindowState *event,
+                                    void *opaque)
+{
+    struct vconsole_domain *dom = opaque;
+
+    dom->iconified = event->new_window_state & GDK_WINDOW_STATE_ICONIFIED;
+    if (!dom->iconified)
+        domain_flush_deferred(dom);
+    return FALSE;
+}
+
 void domain_untabify(struct vconsole_domain *dom)
 {
     struct vconsole_window *win = dom->conn->win;
@@ -429,300 +1149,694 @@ void domain_untabify(struct vconsole_domain *dom)
     domain_vte_geometry_hints(dom, GTK_WINDOW(dom->window));
     g_signal_connect(dom->window, "delete-event",
                      G_CALLBACK(domain_window_close), dom);
+    g_signal_connect(dom->window, "window-state-event",
+                     G_CALLBACK(domain_window_state), dom);
 
     gtk_widget_show_all(dom->window);
+    domain_flush_deferred(dom);
 }
 
-void domain_start(struct vconsole_domain *dom, bool reset_nvram)
+/*
+ * Guest actions run in a per-connection worker thread (one thread, so
+ * actions for a host are executed in order), a managed save of a big
+ * guest must not freeze the user interface.  The worker checks the
+ * guest state itself and does the libvirt call, domain_action_done()
+ * reports the result in the tab status line.  Long running jobs (save,
+ * restore) show progress, polled by a helper thread while the worker
+ * waits for the job, see domain_action_progress_thread().
+ */
+
+static void domain_action_free(struct domain_action *action)
 {
-    virDomainPtr d = virDomainLookupByUUIDString(dom->conn->ptr, dom->uuid);
-    uint32_t flags = 0;
-
-    if (reset_nvram)
-        flags |= VIR_DOMAIN_START_RESET_NVRAM;
+    if (action->timer)
+        g_source_remove(action->timer);
+    virDomainFree(action->d);
+    g_object_unref(action->cancel);
+    g_mutex_clear(&action->lock);
+    g_cond_clear(&action->cond);
+    g_free(action->error);
+    g_free(action);
+}
 
-    domain_update_info(dom, d);
-    switch (dom->info.state) {
-    case VIR_DOMAIN_SHUTOFF:
-        if (dom->vte && dom->conn->cap_start_paused) {
-            flags |= VIR_DOMAIN_START_PAUSED;
-            dom->unpause = TRUE;
+static int domain_action_call(struct domain_action *action, int state)
+{
+    virDomainPtr d = action->d;
+
+    switch (action->type) {
+    case DOMAIN_ACTION_START:
+        if (state == VIR_DOMAIN_SHUTOFF) {
+            if (action->start_paused) {
+                action->started_paused = TRUE;
+                return virDomainCreateWithFlags
+                    (d, action->flags | VIR_DOMAIN_START_PAUSED);
+            }
+            return virDomainCreateWithFlags(d, action->flags);
         }
-        virDomainCreateWithFlags(d, flags);
+        if (state == VIR_DOMAIN_PAUSED)
+            return virDomainResume(d);
         break;
-    case VIR_DOMAIN_PAUSED:
-        virDomainResume(d);
+    case DOMAIN_ACTION_PAUSE:
+        if (state == VIR_DOMAIN_RUNNING)
+            return virDomainSuspend(d);
         break;
-    default:
-        fprintf(stderr, "%s: invalid guest state: %s\n",
-                __func__, domain_state_name(dom));
+    case DOMAIN_ACTION_SAVE:
+        if (state == VIR_DOMAIN_RUNNING || state == VIR_DOMAIN_PAUSED)
+            return virDomainManagedSave(d, 0);
+        break;
+    case DOMAIN_ACTION_REBOOT:
+        if (state == VIR_DOMAIN_RUNNING)
+            return virDomainReboot(d, 0);
+        break;
+    case DOMAIN_ACTION_SHUTDOWN:
+        if (state == VIR_DOMAIN_RUNNING)
+            return virDomainShutdown(d);
+        break;
+    case DOMAIN_ACTION_RESET:
+        if (state == VIR_DOMAIN_RUNNING)
+            return virDomainReset(d, 0);
+        break;
+    case DOMAIN_ACTION_KILL:
+        if (state == VIR_DOMAIN_RUNNING)
+            return virDomainDestroy(d);
+        break;
+    case DOMAIN_ACTION_UNDEFINE:
+        return virDomainUndefineFlags(d, VIR_DOMAIN_UNDEFINE_NVRAM);
     }
-    virDomainFree(d);
+
+    if (debug)
+        fprintf(stderr, "%s: %s: invalid guest state: %s\n", __func__,
+                action_name[action->type], domain_state_str(state));
+    action->error = g_strdup_printf("invalid guest state: %s",
+                                    domain_state_str(state));
+    return -1;
 }
 
-void domain_pause(struct vconsole_domain *dom)
-{
-    virDomainPtr d = virDomainLookupByUUIDString(dom->conn->ptr, dom->uuid);
+static gboolean domain_action_done(gpointer opaque);
 
-    domain_update_info(dom, d);
-    switch (dom->info.state) {
-    case VIR_DOMAIN_RUNNING:
-        virDomainSuspend(d);
-        break;
-    default:
-        fprintf(stderr, "%s: invalid guest state: %s\n",
-                __func__, domain_state_name(dom));
+/* helper thread, polls the job once per second until the worker is done */
+static gpointer domain_action_progress_thread(gpointer data)
+{
+    struct domain_action *action = data;
+    virDomainJobInfo job;
+    gint64 deadline;
+
+    g_mutex_lock(&action->lock);
+    while (g_atomic_int_get(&action->running)) {
+        deadline = g_get_monotonic_time() + G_USEC_PER_SEC;
+        if (g_cond_wait_until(&action->cond, &action->lock, deadline))
+            continue;
+        g_mutex_unlock(&action->lock);
+        if (virDomainGetJobInfo(action->d, &job) == 0 &&
+            job.type != VIR_DOMAIN_JOB_NONE) {
+            if (job.dataTotal)
+                g_atomic_int_set(&action->progress,
+                                 job.dataProcessed * 100 / job.dataTotal);
+            else if (job.memTotal)
+                g_atomic_int_set(&action->progress,
+                                 job.memProcessed * 100 / job.memTotal);
+        }
+        g_mutex_lock(&action->lock);
     }
-    virDomainFree(d);
+    g_mutex_unlock(&action->lock);
+    return NULL;
 }
 
-void domain_save(struct vconsole_domain *dom)
+/* worker thread, no gtk here */
+static void domain_action_run(gpointer data, gpointer user_data)
 {
-    virDomainPtr d = virDomainLookupByUUIDString(dom->conn->ptr, dom->uuid);
+    struct domain_action *action = data;
+    GThread *progress = NULL;
+    virDomainInfo info;
+    virErrorPtr err;
 
-    domain_update_info(dom, d);
-    switch (dom->info.state) {
-    case VIR_DOMAIN_RUNNING:
-    case VIR_DOMAIN_PAUSED:
-        virDomainManagedSave(d, 0);
-        break;
-    default:
-        fprintf(stderr, "%s: invalid guest state: %s\n",
-                __func__, domain_state_name(dom));
+    if (g_cancellable_is_cancelled(action->cancel)) {
+        action->rc = -1;
+        goto done;
     }
-    virDomainFree(d);
+
+    g_atomic_int_set(&action->running, 1);
+    if (action->long_job)
+        progress = g_thread_new("action-progress",
+                                domain_action_progress_thread, action);
+    action->rc = virDomainGetInfo(action->d, &info);
+    if (action->rc == 0)
+        action->rc = domain_action_call(action, info.state);
+    if (action->rc < 0 && !action->error) {
+        err = virGetLastError();
+        action->error = g_strdup(err && err->message
+                                 ? err->message : "failed");
+    }
+    g_mutex_lock(&action->lock);
+    g_atomic_int_set(&action->running, 0);
+    g_cond_signal(&action->cond);
+    g_mutex_unlock(&action->lock);
+    if (progress)
+        g_thread_join(progress);
+
+done:
+    g_idle_add(domain_action_done, action);
 }
 
-void domain_reboot(struct vconsole_domain *dom)
+/* gtk thread, shows what domain_action_progress_thread() found */
+static gboolean domain_action_progress(gpointer opaque)
 {
-    virDomainPtr d = virDomainLookupByUUIDString(dom->conn->ptr, dom->uuid);
+    struct domain_action *action = opaque;
+    struct vconsole_domain *dom;
 
-    domain_update_info(dom, d);
-    switch (dom->info.state) {
-    case VIR_DOMAIN_RUNNING:
-        virDomainReboot(d, 0);
-        break;
-    default:
-        fprintf(stderr, "%s: invalid guest state: %s\n",
-                __func__, domain_state_name(dom));
-    }
-    virDomainFree(d);
+    if (g_cancellable_is_cancelled(action->cancel) ||
+        g_atomic_int_get(&action->progress) < 0)
+        return TRUE;
+
+    dom = g_hash_table_lookup(action->conn->domains, action->uuid);
+    if (dom)
+        domain_update_status(dom);
+    return TRUE;
 }
 
-void domain_shutdown(struct vconsole_domain *dom)
+static gboolean domain_action_done(gpointer opaque)
 {
-    virDomainPtr d = virDomainLookupByUUIDString(dom->conn->ptr, dom->uuid);
+    struct domain_action *action = opaque;
+    struct vconsole_domain *dom;
 
-    domain_update_info(dom, d);
-    switch (dom->info.state) {
-    case VIR_DOMAIN_RUNNING:
-        virDomainShutdown(d);
-        break;
-    default:
-        fprintf(stderr, "%s: invalid guest state: %s\n",
-                __func__, domain_state_name(dom));
+    if (g_cancellable_is_cancelled(action->cancel))
+        goto out;
+
+    dom = g_hash_table_lookup(action->conn->domains, action->uuid);
+    if (!dom)
+        goto out;
+    if (debug)
+        fprintf(stderr, "%s: %s: %s %s%s%s\n", __func__, dom->name,
+                action_name[action->type],
+                action->rc < 0 ? "failed" : "done",
+                action->error ? ": " : "",
+                action->error ? action->error : "");
+
+    if (action->start_paused && !action->started_paused)
+        dom->unpause = FALSE;
+    if (dom->action == action)
+        dom->action = NULL;
+    g_free(dom->action_result);
+    dom->action_result = g_strdup_printf("%s %s%s%s",
+                                         action_name[action->type],
+                                         action->rc < 0 ? "failed" : "done",
+                                         action->error ? ": " : "",
+                                         action->error ? action->error : "");
+    domain_update_status(dom);
+    domain_poll_soon(dom);
+
+out:
+    domain_action_free(action);
+    return FALSE;
+}
+
+static void domain_action_queue(struct vconsole_domain *dom,
+                                enum domain_action_type type, uint32_t flags)
+{
+    struct vconsole_connect *conn = dom->conn;
+    struct domain_action *action;
+
+    if (!conn->actions)
+        conn->actions = g_thread_pool_new(domain_action_run, NULL,
+                                          1, FALSE, NULL);
+
+    action = g_new0(struct domain_action, 1);
+    action->type = type;
+    action->conn = conn;
+    action->cancel = g_object_ref(conn->cancel);
+    action->d = dom->d;
+    virDomainRef(dom->d);
+    memcpy(action->uuid, dom->uuid, sizeof(action->uuid));
+    action->flags = flags;
+    action->progress = -1;
+    g_mutex_init(&action->lock);
+    g_cond_init(&action->cond);
+
+    if (type == DOMAIN_ACTION_START &&
+        dom->info.state == VIR_DOMAIN_SHUTOFF &&
+        dom->vte && conn->cap_start_paused) {
+        /* resume once the console is connected, see domain_update() */
+        action->start_paused = TRUE;
+        dom->unpause = TRUE;
     }
-    virDomainFree(d);
+    if (type == DOMAIN_ACTION_SAVE ||
+        (type == DOMAIN_ACTION_START && dom->saved)) {
+        action->long_job = TRUE;
+        action->timer = g_timeout_add_seconds(1, domain_action_progress,
+                                              action);
+    }
+
+    dom->action = action;
+    g_free(dom->action_result);
+    dom->action_result = NULL;
+    domain_update_status(dom);
+    g_thread_pool_push(conn->actions, action, NULL);
 }
 
-void domain_reset(struct vconsole_domain *dom)
+void domain_start(struct vconsole_domain *dom, bool reset_nvram)
 {
-    virDomainPtr d = virDomainLookupByUUIDString(dom->conn->ptr, dom->uuid);
+    uint32_t flags = 0;
 
-    domain_update_info(dom, d);
-    switch (dom->info.state) {
-    case VIR_DOMAIN_RUNNING:
-        virDomainReset(d, 0);
-        break;
-    default:
-        fprintf(stderr, "%s: invalid guest state: %s\n",
-                __func__, domain_state_name(dom));
-    }
-    virDomainFree(d);
+    if (reset_nvram)
+        flags |= VIR_DOMAIN_START_RESET_NVRAM;
+    domain_action_queue(dom, DOMAIN_ACTION_START, flags);
 }
 
-void domain_kill(struct vconsole_domain *dom)
+void domain_pause(struct vconsole_domain *dom)
 {
-    virDomainPtr d = virDomainLookupByUUIDString(dom->conn->ptr, dom->uuid);
+    domain_action_queue(dom, DOMAIN_ACTION_PAUSE, 0);
+}
 
-    domain_update_info(dom, d);
-    switch (dom->info.state) {
-    case VIR_DOMAIN_RUNNING:
-        virDomainDestroy(d);
-        break;
-    default:
-        fprintf(stderr, "%s: invalid guest state: %s\n",
-                __func__, domain_state_name(dom));
-    }
-    virDomainFree(d);
+void domain_save(struct vconsole_domain *dom)
+{
+    domain_action_queue(dom, DOMAIN_ACTION_SAVE, 0);
 }
 
-void domain_undefine(struct vconsole_domain *dom)
+void domain_reboot(struct vconsole_domain *dom)
 {
-    virDomainPtr d = virDomainLookupByUUIDString(dom->conn->ptr, dom->uuid);
+    domain_action_queue(dom, DOMAIN_ACTION_REBOOT, 0);
+}
 
-    virDomainUndefineFlags(d, VIR_DOMAIN_UNDEFINE_NVRAM);
+void domain_shutdown(struct vconsole_domain *dom)
+{
+    domain_action_queue(dom, DOMAIN_ACTION_SHUTDOWN, 0);
 }
 
-void domain_free(struct vconsole_domain *dom)
+void domain_reset(struct vconsole_domain *dom)
+{
+    domain_action_queue(dom, DOMAIN_ACTION_RESET, 0);
+}
+
+void domain_kill(struct vconsole_domain *dom)
+{
+    domain_action_queue(dom, DOMAIN_ACTION_KILL, 0);
+}
+
+void domain_undefine(struct vconsole_domain *dom)
 {
-    virDomainPtr d = virDomainLookupByUUIDString(dom->conn->ptr, dom->uuid);
+    domain_action_queue(dom, DOMAIN_ACTION_UNDEFINE, 0);
+}
 
-    domain_close_tab(dom, d);
+void domain_free(struct vconsole_domain *dom)
+{
+    domain_sendfile_cancel(dom);
+    domain_disconnect(dom);
+    domain_close_tab(dom);
+    domain_history_free(dom);
+    g_free(dom->rowcache.name);
+    g_free(dom->rowcache.sortkey);
+    g_free(dom->action_result);
+    virDomainFree(dom->d);
+    g_free(dom->console.rxbuf);
+    console_spsc_free(&dom->rxring);
     g_free(dom);
-    virDomainFree(d);
 }
 
-void domain_update(struct vconsole_connect *conn,
-                   virDomainPtr d, virDomainEventType event)
+static void domain_remove(struct vconsole_domain *dom)
 {
-    GtkTreeModel *model = GTK_TREE_MODEL(conn->win->store);
-    GtkTreeIter host, guest;
-    struct vconsole_domain *dom = NULL;
-    void *ptr;
-    gboolean rc;
-    char uuid[VIR_UUID_STRING_BUFLEN];
+    gtk_tree_store_remove(dom->conn->win->store, &dom->row);
+    g_hash_table_remove(dom->conn->domains, dom->uuid);
+    domain_free(dom);
+}
 
-    /* find host */
-    rc = gtk_tree_model_get_iter_first(model, &host);
-    while (rc) {
-        gtk_tree_model_get(model, &host,
-                           CPTR_COL, &ptr,
-                           -1);
-        if (ptr == conn)
-            break;
-        rc = gtk_tree_model_iter_next(model, &host);
-    }
-    assert(ptr == conn);
+static struct vconsole_domain *domain_get(struct vconsole_connect *conn,
+                                          virDomainPtr d, GtkTreeIter *guest)
+{
+    GtkTreeIter *host;
+    struct vconsole_domain *dom;
+    char uuid[VIR_UUID_STRING_BUFLEN];
 
     /* find guest */
     virDomainGetUUIDString(d, uuid);
-    rc = gtk_tree_model_iter_nth_child(model, &guest, &host, 0);
-    while (rc) {
-        gtk_tree_model_get(model, &guest,
-                           DPTR_COL, &dom,
-                           -1);
-        if (strcmp(uuid, dom->uuid) == 0)
-            break;
-        dom = NULL;
-        rc = gtk_tree_model_iter_next(model, &guest);
+    dom = g_hash_table_lookup(conn->domains, uuid);
+    if (dom) {
+        *guest = dom->row;
+        return dom;
     }
 
     /* no guest found -> create new */
-    if (dom == NULL) {
-        dom = g_new0(struct vconsole_domain, 1);
-        dom->conn = conn;
-        virDomainGetUUIDString(d, dom->uuid);
-        gtk_tree_store_append(conn->win->store, &guest, &host);
-        gtk_tree_store_set(conn->win->store, &guest,
-                           DPTR_COL, dom, -1);
+    host = g_hash_table_lookup(conn->win->hosts, conn);
+    if (!host)
+        return NULL;
+    dom = g_new0(struct vconsole_domain, 1);
+    dom->conn = conn;
+    dom->d = d;
+    virDomainRef(d);
+    virDomainGetUUIDString(d, dom->uuid);
+    gtk_tree_store_insert_with_values(conn->win->store, guest, host, -1,
+                                      DPTR_COL, dom, -1);
+    dom->row = *guest;
+    g_hash_table_insert(conn->domains, dom->uuid, dom);
+    return dom;
+}
+
+/* add guest with info collected by the caller, no RPCs */
+void domain_add(struct vconsole_connect *conn, virDomainPtr d,
+                virDomainInfo *info, gboolean saved)
+{
+    struct vconsole_domain *dom;
+    GtkTreeIter guest;
+    struct timeval ts;
+
+    dom = domain_get(conn, d, &guest);
+    if (!dom)
+        return;
+
+    gettimeofday(&ts, NULL);
+    g_free(dom->name);
+    dom->name  = g_strdup(virDomainGetName(d));
+    dom->id    = virDomainGetID(d);
+    dom->console.name = dom->name;
+    dom->saved = saved;
+    domain_set_info(dom, &ts, info);
+    domain_update_tree_store(dom, &guest);
+    domain_poll_soon(dom);
+
+    if (conn->win->vm_history && info->state == VIR_DOMAIN_RUNNING)
+        domain_connect(dom);
+}
+
+/*
+ * Lifecycle events carry the new state, so there is no need to ask
+ * libvirt.  Only guests we know nothing about yet get a full
+ * domain_update_info().  Load and memory of running guests are picked
+ * up by the poll scheduler.
+ */
+static void domain_event_state(struct vconsole_domain *dom,
+                               virDomainPtr d, int event, int detail)
+{
+    switch (event) {
+    case VIR_DOMAIN_EVENT_STARTED:
+    case VIR_DOMAIN_EVENT_RESUMED:
+        dom->info.state = VIR_DOMAIN_RUNNING;
+        dom->id = virDomainGetID(d);
+        if (event == VIR_DOMAIN_EVENT_STARTED)
+            dom->saved = FALSE;  /* managed save image is gone on start */
+        break;
+    case VIR_DOMAIN_EVENT_SUSPENDED:
+        dom->info.state = VIR_DOMAIN_PAUSED;
+        break;
+    case VIR_DOMAIN_EVENT_STOPPED:
+        dom->info.state = VIR_DOMAIN_SHUTOFF;
+        dom->id = -1;
+        if (detail == VIR_DOMAIN_EVENT_STOPPED_SAVED &&
+            dom->conn->cap_migration)
+            dom->saved = virDomainHasManagedSaveImage(dom->d, 0) > 0;
+        break;
+    case VIR_DOMAIN_EVENT_CRASHED:
+        dom->info.state = VIR_DOMAIN_CRASHED;
+        break;
+#if LIBVIR_VERSION_NUMBER >= 10000 /* 0.10.0 */
+    case VIR_DOMAIN_EVENT_PMSUSPENDED:
+        dom->info.state = VIR_DOMAIN_PMSUSPENDED;
+        break;
+#endif
+    default:
+        break;
     }
+}
+
+void domain_update(struct vconsole_connect *conn,
+                   virDomainPtr d, virDomainEventType event, int detail)
+{
+    GtkTreeIter guest;
+    struct vconsole_domain *dom;
+    const char *name;
+
+    dom = domain_get(conn, d, &guest);
+    if (!dom)
+        return;
 
     /* handle events */
     switch (event) {
     case VIR_DOMAIN_EVENT_UNDEFINED:
-        gtk_tree_store_remove(conn->win->store, &guest);
-        domain_free(dom);
+        domain_remove(dom);
         return;
+    case VIR_DOMAIN_EVENT_DEFINED:
+        /* might be a new incarnation, refresh handle */
+        if (dom->d != d) {
+            virDomainRef(d);
+            virDomainFree(dom->d);
+            dom->d = d;
+        }
+        name = virDomainGetName(d);
+        if (g_strcmp0(dom->name, name) != 0) {
+            g_free(dom->name);
+            dom->name = g_strdup(name);
+            dom->console.name = dom->name;
+        }
+        break;
     case VIR_DOMAIN_EVENT_STARTED:
-        if (dom->vbox)
-            domain_connect(dom, d);
+        if (dom->vbox || conn->win->vm_history)
+            domain_connect(dom);
         break;
     case VIR_DOMAIN_EVENT_STOPPED:
-        domain_disconnect(dom, d);
+        domain_disconnect(dom);
+        break;
+    case VIR_DOMAIN_EVENT_CRASHED:
+        domain_history_dump(dom);
         break;
     default:
         break;
     }
 
     /* update guest info */
-    if (domain_update_info(dom, d) != 0) {
-        gtk_tree_store_remove(conn->win->store, &guest);
-        domain_free(dom);
-        return;
+    if (!dom->ts.tv_sec) {
+        /* new guest */
+        if (domain_update_info(dom) != 0) {
+            domain_remove(dom);
+            return;
+        }
+    } else {
+        domain_event_state(dom, d, event, detail);
     }
 
     /* update tree store cols */
     domain_update_tree_store(dom, &guest);
+    domain_update_status(dom);
+    domain_poll_soon(dom);
 
     if (dom->unpause && dom->info.state == VIR_DOMAIN_PAUSED) {
-        virDomainResume(d);
         dom->unpause = FALSE;
+        domain_start(dom, false);
     }
 }
 
+static struct vconsole_domain *domain_find(struct vconsole_connect *conn,
+                                           virDomainPtr d)
+{
+    char uuid[VIR_UUID_STRING_BUFLEN];
+
+    virDomainGetUUIDString(d, uuid);
+    return g_hash_table_lookup(conn->domains, uuid);
+}
+
+void domain_event_reboot(struct vconsole_connect *conn, virDomainPtr d)
+{
+    static const char reboot[] = "\n*** vconsole: guest reboot ***\n";
+    struct vconsole_domain *dom = domain_find(conn, d);
+
+    /* nothing in the guest list changes, just mark it in the log */
+    if (dom && dom->log)
+        logwriter_write(dom->log, reboot, sizeof(reboot) - 1);
+}
+
+void domain_event_balloon(struct vconsole_connect *conn, virDomainPtr d,
+                          unsigned long long actual)
+{
+    struct vconsole_domain *dom = domain_find(conn, d);
+
+    if (!dom)
+        return;
+    dom->info.memory = actual;
+    domain_update_tree_store(dom, &dom->row);
+}
+
+void domain_event_job_completed(struct vconsole_connect *conn,
+                                virDomainPtr d)
+{
+    struct vconsole_domain *dom = domain_find(conn, d);
+
+    /* a finished managed save shows up as stopped/saved already */
+    if (!dom || !conn->cap_migration)
+        return;
+    dom->saved = virDomainHasManagedSaveImage(dom->d, 0) > 0;
+    domain_update_tree_store(dom, &dom->row);
+    domain_update_status(dom);
+}
+
+/* ------------------------------------------------------------------ */
+
+/*
+ * Poll scheduler, called once per POLL_TICK.  Each guest has its own
+ * deadline: running guests with a visible terminal are polled every
+ * POLL_FAST seconds.  While the guest list is shown running guests
+ * are polled every POLL_FAST seconds too if the host has bulk stats
+ * (one rpc for all guests), every POLL_LIST seconds otherwise.  Other
+ * running guests are polled every POLL_SLOW seconds.  Inactive guests
+ * are not polled at all, lifecycle events keep them up-to-date.
+ *
+ * Without bulk stats each guest costs a few synchronous rpcs, so at
+ * most POLL_FALLBACK_MAX guests are polled per tick, the others stay
+ * due and are picked up by the next ticks.  Intervals are stretched
+ * for hosts where a poll tick takes long, so polling doesn't eat the
+ * link or the user interface.
+ */
+#define POLL_FAST               2     /* seconds */
+#define POLL_LIST               10    /* seconds */
+#define POLL_SLOW               30    /* seconds */
+#define POLL_COST_FACTOR        50    /* interval >= factor * tick cost */
+#define POLL_FALLBACK_MAX       16    /* guests per tick without bulk */
+
+static int domain_poll_interval(struct vconsole_domain *dom)
+{
+    struct vconsole_window *win = dom->conn->win;
+    gint64 backoff;
+    int interval;
+
+    switch (dom->info.state) {
+    case VIR_DOMAIN_NOSTATE:
+    case VIR_DOMAIN_SHUTOFF:
+    case VIR_DOMAIN_CRASHED:
+        return 0;
+    default:
+        break;
+    }
+
+    if (domain_visible(dom))
+        interval = POLL_FAST;
+    else if (!win->iconified &&
+             gtk_notebook_get_current_page(GTK_NOTEBOOK(win->notebook)) == 0)
+        interval = dom->conn->cap_bulk_stats ? POLL_FAST : POLL_LIST;
+    else
+        interval = POLL_SLOW;
+
+    backoff = dom->conn->poll_cost * POLL_COST_FACTOR / G_USEC_PER_SEC;
+    return MAX(interval, backoff);
+}
+
+/* poll on the next tick */
+void domain_poll_soon(struct vconsole_domain *dom)
+{
+    dom->poll_next = 0;
+}
+
+static void domain_update_host(struct vconsole_connect *conn,
+                               GtkTreeIter *row)
+{
+    struct vconsole_window *win = conn->win;
+    struct vconsole_domain *dom;
+    GHashTableIter guests;
+    unsigned long memory = 0, vcpus = 0;
+    char mem[20];
+
+    g_hash_table_iter_init(&guests, conn->domains);
+    while (g_hash_table_iter_next(&guests, NULL, (gpointer *)&dom)) {
+        if (dom->info.state == VIR_DOMAIN_RUNNING) {
+            memory += dom->info.memory;
+            vcpus  += dom->info.nrVirtCpu;
+        }
+    }
+    snprintf(mem, sizeof(mem), "%ld M", memory / 1024);
+    gtk_tree_store_set(win->store,     row,
+                       NR_CPUS_COL,    vcpus,
+                       MEMORY_COL,     mem,
+                       HAS_MEMCPU_COL, (gboolean)(memory > 0),
+                       -1);
+}
+
 void domain_update_all(struct vconsole_window *win)
 {
-    GtkTreeModel *model = GTK_TREE_MODEL(win->store);
-    GtkTreeIter host, guest;
     struct vconsole_connect *conn;
     struct vconsole_domain *dom;
-    char mem[20];
-    virDomainPtr d;
-    unsigned long memory, vcpus;
-    int rc, domcount, errcount;
+    GtkTreeIter *row;
+    GHashTableIter hosts, guests;
+    GPtrArray *due;
+    gint64 now, start, cost;
+    int interval, errcount;
+    gboolean bulk, polled = FALSE;
+    guint i;
+
+    now = g_get_monotonic_time();
+    due = g_ptr_array_new();
 
     /* all hosts */
-    rc = gtk_tree_model_get_iter_first(model, &host);
-    while (rc) {
-        gtk_tree_model_get(model, &host,
-                           CPTR_COL, &conn,
-                           -1);
-
-        memory = 0;
-        vcpus = 0;
-        domcount = 0;
+    g_hash_table_iter_init(&hosts, win->hosts);
+    while (g_hash_table_iter_next(&hosts, (gpointer *)&conn, (gpointer *)&row)) {
+        if (!conn->ptr)
+            continue;  /* still connecting */
+
+        /* guests which are due */
+        g_ptr_array_set_size(due, 0);
+        g_hash_table_iter_init(&guests, conn->domains);
+        while (g_hash_table_iter_next(&guests, NULL, (gpointer *)&dom)) {
+            interval = domain_poll_interval(dom);
+            if (!interval)
+                continue;
+            /* moved to a faster tier -> pull in the deadline */
+            dom->poll_next = MIN(dom->poll_next,
+                                 now + interval * G_USEC_PER_SEC);
+            if (now < dom->poll_next)
+                continue;
+            if (!conn->cap_bulk_stats && due->len >= POLL_FALLBACK_MAX)
+                continue;  /* stays due, next tick */
+            dom->poll_next = now + interval * G_USEC_PER_SEC;
+            g_ptr_array_add(due, dom);
+        }
+        if (!due->len)
+            continue;
         errcount = 0;
 
-        /* all guests */
-        rc = gtk_tree_model_iter_nth_child(model, &guest, &host, 0);
-        while (rc) {
-            domcount++;
-            gtk_tree_model_get(model, &guest,
-                               DPTR_COL, &dom,
-                               -1);
-            /* update */
-            d = virDomainLookupByUUIDString(conn->ptr, dom->uuid);
-            if (d == NULL) {
-                errcount++;
-            } else if (0 != domain_update_info(dom, d)) {
+        /*
+         * bulk update, per-guest calls are the fallback, also for this
+         * tick when the bulk call failed.  Only if the guests fail one
+         * by one too the host is considered gone.
+         */
+        start = g_get_monotonic_time();
+        bulk = conn->cap_bulk_stats && domain_update_stats(conn, due) == 0;
+        for (i = 0; i < due->len; i++) {
+            dom = g_ptr_array_index(due, i);
+            if (!bulk && 0 != domain_update_info(dom))
                 errcount++;
-            }
-            if (dom->info.state == VIR_DOMAIN_RUNNING) {
-                memory += dom->info.memory;
-                vcpus  += dom->info.nrVirtCpu;
-            }
-            domain_update_tree_store(dom, &guest);
-            if (d)
-                virDomainFree(d);
-            rc = gtk_tree_model_iter_next(model, &guest);
+            domain_update_tree_store(dom, &dom->row);
         }
+
+        /* time the whole tick took for this host, smoothed */
+        cost = g_get_monotonic_time() - start;
+        conn->poll_cost = conn->poll_cost
+            ? (conn->poll_cost * 7 + cost) / 8
+            : cost;
+        if (debug > 1)
+            fprintf(stderr, "%s: %u guests polled, %s, %" G_GINT64_FORMAT
+                    " us, tree updates %lu applied, %lu skipped\n",
+                    __func__, due->len, bulk ? "bulk" : "per guest",
+                    conn->poll_cost,
+                    tree_updates_applied, tree_updates_skipped);
+
         if (errcount) {
-            fprintf(stderr, "%s: %d/%d\n", __func__, errcount, domcount);
+            fprintf(stderr, "%s: %d/%u\n", __func__, errcount, due->len);
         }
-        if (errcount && errcount == domcount) {
+        if (errcount && errcount == due->len) {
             /* all domains failed, disconnected ? */
+            g_ptr_array_free(due, TRUE);
             connect_close(conn->ptr, 0, conn);
             return;
         }
-
-        snprintf(mem, sizeof(mem), "%ld M", memory / 1024);
-        gtk_tree_store_set(win->store,     &host,
-                           NR_CPUS_COL,    vcpus,
-                           MEMORY_COL,     mem,
-                           HAS_MEMCPU_COL, (gboolean)(memory > 0),
-                           -1);
-
-        rc = gtk_tree_model_iter_next(model, &host);
+        domain_update_host(conn, row);
+        polled = TRUE;
     }
+    g_ptr_array_free(due, TRUE);
+
+    /* rx rates are updated now, might shift scrollback around */
+    if (polled)
+        domain_scrollback_rebalance(win);
 }
 
 static void domain_close_tab_btn(GtkWidget *btn, gpointer opaque)
 {
     struct vconsole_domain *dom = opaque;
-    virDomainPtr d = virDomainLookupByUUIDString(dom->conn->ptr, dom->uuid);
 
-    domain_close_tab(dom, d);
+    domain_close_tab(dom);
+    domain_scrollback_rebalance(dom->conn->win);
 }
 
 static GtkWidget *tab_label_with_close_button(const char *labeltext,
@@ -747,7 +1861,6 @@ static GtkWidget *tab_label_with_close_button(const char *labeltext,
 
 void domain_activate(struct vconsole_domain *dom)
 {
-    virDomainPtr d = virDomainLookupByUUIDString(dom->conn->ptr, dom->uuid);
     struct vconsole_window *win = dom->conn->win;
     GtkWidget *lhbox, *fstatus;
     gint page;
@@ -762,7 +1875,6 @@ void domain_activate(struct vconsole_domain *dom)
         dom->vte = vte_terminal_new();
         g_signal_connect(dom->vte, "commit",
                          G_CALLBACK(domain_user_input), dom);
-        vte_terminal_set_scrollback_lines(VTE_TERMINAL(dom->vte), 9999);
         vte_terminal_set_size(VTE_TERMINAL(dom->vte), 80, 24);
 
         dom->status = gtk_label_new("-");
@@ -770,6 +1882,7 @@ void domain_activate(struct vconsole_domain *dom)
         gtk_widget_set_valign(dom->status, GTK_ALIGN_CENTER);
 
         dom->vbox = gtk_box_new(GTK_ORIENTATION_VERTICAL, 1);
+        g_object_set_data(G_OBJECT(dom->vbox), "vconsole-domain", dom);
         gtk_container_set_border_width(GTK_CONTAINER(dom->vbox), 1);
         gtk_box_pack_start(GTK_BOX(dom->vbox), dom->vte, TRUE, TRUE, 0);
         fstatus = gtk_frame_new(NULL);
@@ -787,52 +1900,35 @@ void domain_activate(struct vconsole_domain *dom)
         gtk_notebook_set_current_page(GTK_NOTEBOOK(win->notebook), page);
         domain_configure_vte(dom);
         domain_vte_geometry_hints(dom, GTK_WINDOW(win->toplevel));
+        domain_scrollback_rebalance(win);
+        console_ring_foreach(&dom->history, domain_history_feed, dom);
 
-        domain_update_info(dom, d);
+        domain_update_info(dom);
         if (dom->info.state == VIR_DOMAIN_RUNNING)
-            domain_connect(dom, d);
+            domain_connect(dom);
     }
-
-    virDomainFree(d);
 }
 
 struct vconsole_domain *domain_find_current_tab(struct vconsole_window *win)
 {
-    GtkTreeModel *model = GTK_TREE_MODEL(win->store);
-    GtkTreeIter host, guest;
-    struct vconsole_domain *dom;
-    int rc, cpage, dpage;
-
-    cpage = gtk_notebook_get_current_page(GTK_NOTEBOOK(win->notebook));
-    rc = gtk_tree_model_get_iter_first(model, &host);
-    while (rc) {
-        rc = gtk_tree_model_iter_nth_child(model, &guest, &host, 0);
-        while (rc) {
-            gtk_tree_model_get(model, &guest,
-                               DPTR_COL, &dom,
-                               -1);
-            if (dom->vbox) {
-                dpage = gtk_notebook_page_num(GTK_NOTEBOOK(win->notebook), dom->vbox);
-                if (dpage == cpage)
-                    return dom;
-            }
-            rc = gtk_tree_model_iter_next(model, &guest);
-        }
-        rc = gtk_tree_model_iter_next(model, &host);
-    }
-    return NULL;
+    GtkNotebook *notebook = GTK_NOTEBOOK(win->notebook);
+    GtkWidget *page;
+
+    page = gtk_notebook_get_nth_page(notebook,
+                                     gtk_notebook_get_current_page(notebook));
+    if (!page)
+        return NULL;
+    return g_object_get_data(G_OBJECT(page), "vconsole-domain");
 }
 
 void domain_close_current_tab(struct vconsole_window *win)
 {
     struct vconsole_domain *dom;
-    virDomainPtr d;
 
     dom = domain_find_current_tab(win);
     if (dom) {
-        d = virDomainLookupByUUIDString(dom->conn->ptr, dom->uuid);
-        domain_close_tab(dom, d);
-        virDomainFree(d);
+        domain_close_tab(dom);
+        domain_scrollback_rebalance(win);
     }
 }
 
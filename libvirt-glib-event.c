@@ -86,8 +86,8 @@ struct gvir_event_handle
     int fd;
     int events;
     int removed;
-    GIOChannel *channel;
-    guint source;
+    int slot;           /* index in active, -1 if no interest */
+    gpointer tag;
     virEventHandleCallback cb;
     void *opaque;
     virFreeCallback ff;
@@ -98,42 +98,146 @@ struct gvir_event_timeout
     int timer;
     int interval;
     int removed;
-    guint source;
+    GSource *source;
     virEventTimeoutCallback cb;
     void *opaque;
     virFreeCallback ff;
 };
 
-GMutex *eventlock = NULL;
-
+/*
+ * Handles and timeouts are indexed by id, libvirt updates them a lot
+ * (writable interest toggles with every rpc).  Separate locks so
+ * handle and timeout operations don't serialize each other.
+ */
+static GMutex *handlelock = NULL;
 static int nextwatch = 1;
-static GPtrArray *handles;
+static GHashTable *handles;     /* watch -> gvir_event_handle */
+static GPtrArray *active;       /* handles with interest */
+
+/*
+ * All libvirt file handles are polled by a single GSource, interest
+ * changes are done in place with g_source_modify_unix_fd() instead
+ * of destroying and recreating a watch.  glib doesn't say which fds
+ * fired, so dispatch queries the handles with interest only, idle
+ * ones (no events requested) are not looked at.
+ */
+static GSource *handlesource;
+
+/* main context libvirt events are dispatched in, NULL is the default */
+static GMainContext *eventctx;
+
+static void
+gvir_event_idle(GSourceFunc func, gpointer data)
+{
+    GSource *idle = g_idle_source_new();
+
+    g_source_set_callback(idle, func, data, NULL);
+    g_source_attach(idle, eventctx);
+    g_source_unref(idle);
+}
 
+static GMutex *timeoutlock = NULL;
 static int nexttimer = 1;
-static GPtrArray *timeouts;
+static GHashTable *timeouts;    /* timer -> gvir_event_timeout */
 
-static gboolean
-gvir_event_handle_dispatch(GIOChannel *source G_GNUC_UNUSED,
-                           GIOCondition condition,
-                           gpointer opaque)
+static GIOCondition
+gvir_event_handle_cond(int events)
 {
-    struct gvir_event_handle *data = opaque;
-    int events = 0;
+    GIOCondition cond = 0;
 
-    if (condition & G_IO_IN)
-        events |= VIR_EVENT_HANDLE_READABLE;
-    if (condition & G_IO_OUT)
-        events |= VIR_EVENT_HANDLE_WRITABLE;
-    if (condition & G_IO_HUP)
-        events |= VIR_EVENT_HANDLE_HANGUP;
-    if (condition & G_IO_ERR)
-        events |= VIR_EVENT_HANDLE_ERROR;
+    if (!events)
+        return 0;
+    cond |= G_IO_HUP | G_IO_ERR;
+    if (events & VIR_EVENT_HANDLE_READABLE)
+        cond |= G_IO_IN;
+    if (events & VIR_EVENT_HANDLE_WRITABLE)
+        cond |= G_IO_OUT;
+    return cond;
+}
 
-    (data->cb)(data->watch, data->fd, events, data->opaque);
+static void
+gvir_event_handle_activate(struct gvir_event_handle *h, gboolean on)
+{
+    struct gvir_event_handle *last;
+
+    if (on == (h->slot >= 0))
+        return;
+    if (on) {
+        h->slot = active->len;
+        g_ptr_array_add(active, h);
+        return;
+    }
+    /* the last entry moves into the free slot */
+    last = g_ptr_array_index(active, active->len - 1);
+    last->slot = h->slot;
+    g_ptr_array_remove_index_fast(active, h->slot);
+    h->slot = -1;
+}
+
+struct gvir_event_ready {
+    struct gvir_event_handle *h;
+    GIOCondition condition;
+};
+
+static gboolean
+gvir_event_source_dispatch(GSource *source,
+                           GSourceFunc callback G_GNUC_UNUSED,
+                           gpointer user_data G_GNUC_UNUSED)
+{
+    struct gvir_event_handle *h;
+    struct gvir_event_ready r;
+    GIOCondition condition;
+    GArray *ready;
+    gboolean removed;
+    guint i;
+    int events;
+
+    /*
+     * Collect the ready handles with their conditions first, callbacks
+     * may call back into handle update/remove.  The tag is only used
+     * here, under the lock.  Handles are freed from an idle callback,
+     * so the pointers stay valid until we are done here.
+     */
+    ready = g_array_new(FALSE, FALSE, sizeof(struct gvir_event_ready));
+    g_mutex_lock(handlelock);
+    for (i = 0; i < active->len; i++) {
+        r.h = g_ptr_array_index(active, i);
+        r.condition = g_source_query_unix_fd(source, r.h->tag);
+        if (r.condition)
+            g_array_append_val(ready, r);
+    }
+    g_mutex_unlock(handlelock);
+
+    for (i = 0; i < ready->len; i++) {
+        h = g_array_index(ready, struct gvir_event_ready, i).h;
+        condition = g_array_index(ready, struct gvir_event_ready, i).condition;
+        /* an earlier callback or another thread may have changed it */
+        g_mutex_lock(handlelock);
+        removed = h->removed;
+        condition &= gvir_event_handle_cond(h->events);
+        g_mutex_unlock(handlelock);
+        if (removed || !condition)
+            continue;
+        events = 0;
+        if (condition & G_IO_IN)
+            events |= VIR_EVENT_HANDLE_READABLE;
+        if (condition & G_IO_OUT)
+            events |= VIR_EVENT_HANDLE_WRITABLE;
+        if (condition & G_IO_HUP)
+            events |= VIR_EVENT_HANDLE_HANGUP;
+        if (condition & G_IO_ERR)
+            events |= VIR_EVENT_HANDLE_ERROR;
+        (h->cb)(h->watch, h->fd, events, h->opaque);
+    }
+    g_array_free(ready, TRUE);
 
     return TRUE;
 }
 
+static GSourceFuncs gvir_event_source_funcs = {
+    .dispatch = gvir_event_source_dispatch,
+};
+
 
 static int
 gvir_event_handle_add(int fd,
@@ -143,36 +247,28 @@ gvir_event_handle_add(int fd,
                       virFreeCallback ff)
 {
     struct gvir_event_handle *data;
-    GIOCondition cond = 0;
     int ret;
 
-    g_mutex_lock(eventlock);
+    g_mutex_lock(handlelock);
 
     data = g_new0(struct gvir_event_handle, 1);
 
-    if (events & VIR_EVENT_HANDLE_READABLE)
-        cond |= G_IO_IN;
-    if (events & VIR_EVENT_HANDLE_WRITABLE)
-        cond |= G_IO_OUT;
-
     data->watch = nextwatch++;
     data->fd = fd;
     data->events = events;
     data->cb = cb;
     data->opaque = opaque;
-    data->channel = g_io_channel_unix_new(fd);
     data->ff = ff;
+    data->slot = -1;
+    data->tag = g_source_add_unix_fd(handlesource, fd,
+                                     gvir_event_handle_cond(events));
+    gvir_event_handle_activate(data, events != 0);
 
-    data->source = g_io_add_watch(data->channel,
-                                  cond,
-                                  gvir_event_handle_dispatch,
-                                  data);
-
-    g_ptr_array_add(handles, data);
+    g_hash_table_insert(handles, GINT_TO_POINTER(data->watch), data);
 
     ret = data->watch;
 
-    g_mutex_unlock(eventlock);
+    g_mutex_unlock(handlelock);
 
     return ret;
 }
@@ -180,21 +276,11 @@ gvir_event_handle_add(int fd,
 static struct gvir_event_handle *
 gvir_event_handle_find(int watch)
 {
-    guint i;
-
-    for (i = 0 ; i < handles->len ; i++) {
-        struct gvir_event_handle *h = g_ptr_array_index(handles, i);
-
-        if (h == NULL) {
-            g_warn_if_reached ();
-            continue;
-        }
-
-        if ((h->watch == watch) && !h->removed) {
-            return h;
-        }
-    }
+    struct gvir_event_handle *h;
 
+    h = g_hash_table_lookup(handles, GINT_TO_POINTER(watch));
+    if (h && !h->removed)
+        return h;
     return NULL;
 }
 
@@ -204,42 +290,24 @@ gvir_event_handle_update(int watch,
 {
     struct gvir_event_handle *data;
 
-    g_mutex_lock(eventlock);
+    g_mutex_lock(handlelock);
 
     data = gvir_event_handle_find(watch);
     if (!data) {
         goto cleanup;
     }
 
-    if (events) {
-        GIOCondition cond = 0;
-        if (events == data->events)
-            goto cleanup;
-
-        if (data->source)
-            g_source_remove(data->source);
-
-        cond |= G_IO_HUP;
-        if (events & VIR_EVENT_HANDLE_READABLE)
-            cond |= G_IO_IN;
-        if (events & VIR_EVENT_HANDLE_WRITABLE)
-            cond |= G_IO_OUT;
-        data->source = g_io_add_watch(data->channel,
-                                      cond,
-                                      gvir_event_handle_dispatch,
-                                      data);
-        data->events = events;
-    } else {
-        if (!data->source)
-            goto cleanup;
+    if (events == data->events)
+        goto cleanup;
 
-        g_source_remove(data->source);
-        data->source = 0;
-        data->events = 0;
-    }
+    /* wakes up the loop if called from another thread */
+    g_source_modify_unix_fd(handlesource, data->tag,
+                            gvir_event_handle_cond(events));
+    data->events = events;
+    gvir_event_handle_activate(data, events != 0);
 
 cleanup:
-    g_mutex_unlock(eventlock);
+    g_mutex_unlock(handlelock);
 }
 
 static gboolean
@@ -250,11 +318,11 @@ _event_handle_remove(gpointer data)
     if (h->ff)
         (h->ff)(h->opaque);
 
-    g_mutex_lock(eventlock);
+    g_mutex_lock(handlelock);
 
-    g_ptr_array_remove_fast(handles, h);
+    g_hash_table_remove(handles, GINT_TO_POINTER(h->watch));
 
-    g_mutex_unlock(eventlock);
+    g_mutex_unlock(handlelock);
 
     return FALSE;
 }
@@ -265,30 +333,28 @@ gvir_event_handle_remove(int watch)
     struct gvir_event_handle *data;
     int ret = -1;
 
-    g_mutex_lock(eventlock);
+    g_mutex_lock(handlelock);
 
     data = gvir_event_handle_find(watch);
     if (!data) {
         goto cleanup;
     }
 
-    if (!data->source)
-        goto cleanup;
-
-    g_source_remove(data->source);
-    data->source = 0;
+    g_source_remove_unix_fd(handlesource, data->tag);
+    gvir_event_handle_activate(data, FALSE);
+    data->tag = NULL;
     data->events = 0;
     /* since the actual watch deletion is done asynchronously, a handle_update call may
      * reschedule the watch before it's fully deleted, that's why we need to mark it as
      * 'removed' to prevent reuse
      */
     data->removed = TRUE;
-    g_idle_add(_event_handle_remove, data);
+    gvir_event_idle(_event_handle_remove, data);
 
     ret = 0;
 
 cleanup:
-    g_mutex_unlock(eventlock);
+    g_mutex_unlock(handlelock);
     return ret;
 }
 
@@ -302,6 +368,30 @@ gvir_event_timeout_dispatch(void *opaque)
     return TRUE;
 }
 
+/* zero interval timeouts are "run asap" in libvirt, use an idle source */
+static GSource *
+gvir_event_timeout_schedule(struct gvir_event_timeout *data)
+{
+    GSource *source;
+
+    if (data->interval == 0)
+        source = g_idle_source_new();
+    else
+        source = g_timeout_source_new(data->interval);
+    g_source_set_priority(source, G_PRIORITY_DEFAULT);
+    g_source_set_callback(source, gvir_event_timeout_dispatch, data, NULL);
+    g_source_attach(source, eventctx);
+    return source;
+}
+
+static void
+gvir_event_timeout_cancel(struct gvir_event_timeout *data)
+{
+    g_source_destroy(data->source);
+    g_source_unref(data->source);
+    data->source = NULL;
+}
+
 static int
 gvir_event_timeout_add(int interval,
                        virEventTimeoutCallback cb,
@@ -311,7 +401,7 @@ gvir_event_timeout_add(int interval,
     struct gvir_event_timeout *data;
     int ret;
 
-    g_mutex_lock(eventlock);
+    g_mutex_lock(timeoutlock);
 
     data = g_new0(struct gvir_event_timeout, 1);
     data->timer = nexttimer++;
@@ -320,15 +410,13 @@ gvir_event_timeout_add(int interval,
     data->opaque = opaque;
     data->ff = ff;
     if (interval >= 0)
-        data->source = g_timeout_add(interval,
-                                     gvir_event_timeout_dispatch,
-                                     data);
+        data->source = gvir_event_timeout_schedule(data);
 
-    g_ptr_array_add(timeouts, data);
+    g_hash_table_insert(timeouts, GINT_TO_POINTER(data->timer), data);
 
     ret = data->timer;
 
-    g_mutex_unlock(eventlock);
+    g_mutex_unlock(timeoutlock);
 
     return ret;
 }
@@ -337,23 +425,13 @@ gvir_event_timeout_add(int interval,
 static struct gvir_event_timeout *
 gvir_event_timeout_find(int timer)
 {
-    guint i;
+    struct gvir_event_timeout *t;
 
     g_return_val_if_fail(timeouts != NULL, NULL);
 
-    for (i = 0 ; i < timeouts->len ; i++) {
-        struct gvir_event_timeout *t = g_ptr_array_index(timeouts, i);
-
-        if (t == NULL) {
-            g_warn_if_reached ();
-            continue;
-        }
-
-        if ((t->timer == timer) && !t->removed) {
-            return t;
-        }
-    }
-
+    t = g_hash_table_lookup(timeouts, GINT_TO_POINTER(timer));
+    if (t && !t->removed)
+        return t;
     return NULL;
 }
 
@@ -364,7 +442,7 @@ gvir_event_timeout_update(int timer,
 {
     struct gvir_event_timeout *data;
 
-    g_mutex_lock(eventlock);
+    g_mutex_lock(timeoutlock);
 
     data = gvir_event_timeout_find(timer);
     if (!data) {
@@ -373,22 +451,19 @@ gvir_event_timeout_update(int timer,
 
     if (interval >= 0) {
         if (data->source)
-            g_source_remove(data->source);
+            gvir_event_timeout_cancel(data);
 
         data->interval = interval;
-        data->source = g_timeout_add(data->interval,
-                                     gvir_event_timeout_dispatch,
-                                     data);
+        data->source = gvir_event_timeout_schedule(data);
     } else {
         if (!data->source)
             goto cleanup;
 
-        g_source_remove(data->source);
-        data->source = 0;
+        gvir_event_timeout_cancel(data);
     }
 
 cleanup:
-    g_mutex_unlock(eventlock);
+    g_mutex_unlock(timeoutlock);
 }
 
 static gboolean
@@ -399,11 +474,11 @@ _event_timeout_remove(gpointer data)
     if (t->ff)
         (t->ff)(t->opaque);
 
-    g_mutex_lock(eventlock);
+    g_mutex_lock(timeoutlock);
 
-    g_ptr_array_remove_fast(timeouts, t);
+    g_hash_table_remove(timeouts, GINT_TO_POINTER(t->timer));
 
-    g_mutex_unlock(eventlock);
+    g_mutex_unlock(timeoutlock);
 
     return FALSE;
 }
@@ -414,7 +489,7 @@ gvir_event_timeout_remove(int timer)
     struct gvir_event_timeout *data;
     int ret = -1;
 
-    g_mutex_lock(eventlock);
+    g_mutex_lock(timeoutlock);
 
     data = gvir_event_timeout_find(timer);
     if (!data) {
@@ -424,28 +499,34 @@ gvir_event_timeout_remove(int timer)
     if (!data->source)
         goto cleanup;
 
-    g_source_remove(data->source);
-    data->source = 0;
+    gvir_event_timeout_cancel(data);
     /* since the actual timeout deletion is done asynchronously, a timeout_update call may
      * reschedule the timeout before it's fully deleted, that's why we need to mark it as
      * 'removed' to prevent reuse
      */
     data->removed = TRUE;
-    g_idle_add(_event_timeout_remove, data);
+    gvir_event_idle(_event_timeout_remove, data);
 
     ret = 0;
 
 cleanup:
-    g_mutex_unlock(eventlock);
+    g_mutex_unlock(timeoutlock);
     return ret;
 }
 
 
 static gpointer event_register_once(gpointer data G_GNUC_UNUSED)
 {
-    eventlock = g_mutex_new();
-    timeouts = g_ptr_array_new_with_free_func(g_free);
-    handles = g_ptr_array_new_with_free_func(g_free);
+    handlelock = g_mutex_new();
+    timeoutlock = g_mutex_new();
+    timeouts = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                     NULL, g_free);
+    handles = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                    NULL, g_free);
+    active = g_ptr_array_new();
+    handlesource = g_source_new(&gvir_event_source_funcs, sizeof(GSource));
+    g_source_set_priority(handlesource, G_PRIORITY_DEFAULT);
+    g_source_attach(handlesource, eventctx);
     virEventRegisterImpl(gvir_event_handle_add,
                          gvir_event_handle_update,
                          gvir_event_handle_remove,
@@ -479,3 +560,29 @@ void gvir_event_register(void)
 
     g_once(&once, event_register_once, NULL);
 }
+
+static gpointer event_thread(gpointer data G_GNUC_UNUSED)
+{
+    GMainLoop *loop = g_main_loop_new(eventctx, FALSE);
+
+    g_main_context_push_thread_default(eventctx);
+    g_main_loop_run(loop);
+    return NULL;
+}
+
+/**
+ * gvir_event_register_thread:
+ *
+ * Like gvir_event_register(), but libvirt events are dispatched by a
+ * private main loop running in a separate thread, so they are not
+ * delayed by whatever the default main loop is busy with.  All libvirt
+ * callbacks (stream events, domain events, close callbacks) run in
+ * that thread then.  Must be called instead of, not after
+ * gvir_event_register().
+ */
+void gvir_event_register_thread(void)
+{
+    eventctx = g_main_context_new();
+    gvir_event_register();
+    g_thread_new("libvirt-events", event_thread, NULL);
+}
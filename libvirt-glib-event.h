@@ -29,6 +29,7 @@
 G_BEGIN_DECLS
 
 void gvir_event_register(void);
+void gvir_event_register_thread(void);
 
 G_END_DECLS
 
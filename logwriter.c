@@ -0,0 +1,863 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+
+#include <time.h>
+
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <glib.h>
+
+#define ZLIB_CONST /* const next_in */
+#include <zlib.h>
+
+#include "logwriter.h"
+
+/*
+ * Console logs are queued in memory and written by a dedicated thread,
+ * so the console never waits for the disk.  Data is kept in chunks of
+ * up to LOGWRITER_CHUNK bytes, each flush writes all queued chunks of a
+ * log with a single writev() call.  Chunks start out at the size of
+ * the write and grow as needed, a slow console with a few bytes per
+ * index slot doesn't pin a full chunk until the next flush.
+ *
+ * In gzip format every flush ends with a sync point, so everything
+ * written so far can be decompressed.  The gzip member is finished
+ * every LOGWRITER_FRAME bytes (or LOGWRITER_FRAME_TIME) and a new one
+ * is started, so a file cut short by a crash loses at most the tail of
+ * the last member.
+ *
+ * Once the active log file <name>.log grows beyond rotate_size or gets
+ * older than rotate_age it is renamed to <name>.log.<N> (gzip:
+ * <name>.log.<N>.gz), with N being one higher than the highest existing
+ * segment.  Active logs always end with ".log" or ".log.gz", so no guest
+ * name can make them look like a segment.  If the total size of all
+ * files below topdir exceeds the quota the oldest rotated segments are
+ * deleted.  Both happens in the writer thread too.
+ *
+ * The first chunk written in each LOGWRITER_INDEX_TIME slot is marked
+ * with its arrival time, the writer thread appends time and file offset
+ * of marked chunks to <logfile>.idx.  gzip logs do a full flush at
+ * each index point, so raw inflate can start right there without
+ * giving up the gzip member (and its compression) for every slot.
+ *
+ * The number of log files kept open is limited to max_open, the least
+ * recently written log is closed when another one needs to be opened.
+ */
+
+#define LOGWRITER_CHUNK      (64 * 1024)
+#define LOGWRITER_FLUSH      (256 * 1024)       /* kick writer */
+#define LOGWRITER_MAX        (4 * 1024 * 1024)  /* drop data */
+#define LOGWRITER_IOV        64
+#define LOGWRITER_FRAME      (1024 * 1024)      /* gzip member size */
+#define LOGWRITER_FRAME_TIME (60 * G_TIME_SPAN_SECOND)
+#define LOGWRITER_QUOTA_TIME (5 * 60 * G_TIME_SPAN_SECOND)
+
+extern int debug;
+
+struct logwriter {
+    char                      *basename;
+    char                      *filename;
+    int                       fd;        /* writer thread only */
+    gboolean                  failed;    /* writer thread only */
+    guint64                   size;      /* writer thread only */
+    time_t                    created;   /* writer thread only */
+    int                       idxfd;     /* writer thread only */
+    gboolean                  indexed;   /* writer thread only */
+    GList                     lru;       /* writer thread only */
+    z_stream                  *zs;       /* writer thread only */
+    size_t                    zframe;
+    gint64                    zstart;
+
+    /* protected by lock */
+    GQueue                    chunks;    /* GByteArray */
+    GQueue                    marks;     /* logwriter_mark */
+    gint64                    slot;
+    size_t                    pending;
+    uint64_t                  dropped;
+    gboolean                  closing;
+};
+
+struct logwriter_mark {
+    GByteArray                *chunk;    /* index point starts here */
+    gint64                    time;
+};
+
+static GMutex lock;
+static GCond cond;
+static GThread *thread;
+static GList *logs;
+static gboolean kick;
+static gboolean quit;
+
+static enum logwriter_sync sync_mode = LOGWRITER_SYNC_INTERVAL;
+static int sync_interval = 1000;
+static enum logwriter_format log_format = LOGWRITER_FORMAT_PLAIN;
+static guint64 rotate_size;
+static int rotate_age;
+static guint64 quota;
+static char *topdir;
+static int max_open;
+static char *appname;
+static GQueue lru;  /* logs with open files, writer thread only */
+
+static const char *sync_names[] = {
+    [ LOGWRITER_SYNC_CLOSE ]     = "close",
+    [ LOGWRITER_SYNC_INTERVAL ]  = "interval",
+    [ LOGWRITER_SYNC_FDATASYNC ] = "fdatasync",
+};
+
+static const char *format_names[] = {
+    [ LOGWRITER_FORMAT_PLAIN ]   = "plain",
+    [ LOGWRITER_FORMAT_GZIP ]    = "gzip",
+};
+
+static const char *format_suffix[] = {
+    [ LOGWRITER_FORMAT_PLAIN ]   = ".log",
+    [ LOGWRITER_FORMAT_GZIP ]    = ".log.gz",
+};
+
+/* appended to "<name>.log.<N>" */
+static const char *segment_suffix[] = {
+    [ LOGWRITER_FORMAT_PLAIN ]   = "",
+    [ LOGWRITER_FORMAT_GZIP ]    = ".gz",
+};
+
+/* ------------------------------------------------------------------ */
+
+static void make_dirs(const char *filename)
+{
+    char *dirname = g_strdup(filename);
+    char *slash = strrchr(dirname, '/');
+
+    if (!slash)
+        goto out;
+    if (slash == dirname)
+        goto out;
+    *slash = 0;
+    if (mkdir(dirname, 0777) < 0) {
+        if (errno != ENOENT)
+            goto err;
+        make_dirs(dirname);
+        if (mkdir(dirname, 0777) < 0)
+            goto err;
+    }
+    goto out;
+
+err:
+    fprintf(stderr, "mkdir %s: %s\n", dirname, strerror(errno));
+out:
+    g_free(dirname);
+}
+
+static void logwriter_file_open(struct logwriter *lw)
+{
+    int flags = O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC;
+    char header[LOGWRITER_INDEX_HEADER];
+    char *idxname;
+    struct stat st;
+
+    lw->fd = open(lw->filename, flags, 0666);
+    if (lw->fd < 0 && errno == ENOENT) {
+        make_dirs(lw->filename);
+        lw->fd = open(lw->filename, flags, 0666);
+    }
+    if (lw->fd < 0) {
+        fprintf(stderr, "open %s: %s\n", lw->filename, strerror(errno));
+        lw->failed = TRUE;
+        return;
+    }
+
+    lw->size = 0;
+    if (fstat(lw->fd, &st) == 0)
+        lw->size = st.st_size;
+    if (!lw->created) {
+        /* appending to an existing log, the last write is our best guess */
+        lw->created = lw->size ? st.st_mtime : time(NULL);
+    }
+    g_queue_push_tail_link(&lru, &lw->lru);
+
+    /* index is best effort, the log works without it */
+    idxname = g_strdup_printf("%s.idx", lw->filename);
+    lw->idxfd = open(idxname, flags, 0666);
+    if (lw->idxfd < 0) {
+        fprintf(stderr, "open %s: %s\n", idxname, strerror(errno));
+    } else if (fstat(lw->idxfd, &st) == 0 && st.st_size == 0) {
+        memset(header, 0, sizeof(header));
+        memcpy(header, LOGWRITER_INDEX_MAGIC, strlen(LOGWRITER_INDEX_MAGIC));
+        if (write(lw->idxfd, header, sizeof(header)) != sizeof(header)) {
+            close(lw->idxfd);
+            lw->idxfd = -1;
+        }
+    }
+    g_free(idxname);
+}
+
+static void logwriter_file_release(struct logwriter *lw)
+{
+    if (lw->fd < 0)
+        return;
+    if (sync_mode == LOGWRITER_SYNC_FDATASYNC)
+        fdatasync(lw->fd);
+    close(lw->fd);
+    lw->fd = -1;
+    if (lw->idxfd >= 0) {
+        close(lw->idxfd);
+        lw->idxfd = -1;
+    }
+    g_queue_unlink(&lru, &lw->lru);
+}
+
+static void logwriter_file_reserve(struct logwriter *lw)
+{
+    if (lw->fd >= 0) {
+        /* move to tail (most recently used) */
+        g_queue_unlink(&lru, &lw->lru);
+        g_queue_push_tail_link(&lru, &lw->lru);
+        return;
+    }
+    while (max_open && lru.length >= max_open) {
+        if (debug > 1)
+            fprintf(stderr, "%s: release %s\n", __func__,
+                    ((struct logwriter *)lru.head->data)->filename);
+        logwriter_file_release(lru.head->data);
+    }
+}
+
+static gboolean logwriter_index_due(struct logwriter *lw, GQueue *marks,
+                                    GByteArray *chunk, gint64 *time)
+{
+    struct logwriter_mark *mark = g_queue_peek_head(marks);
+
+    if (mark && mark->chunk == chunk) {
+        *time = mark->time;
+        g_free(g_queue_pop_head(marks));
+    } else if (!lw->indexed) {
+        /* make sure each file has at least one index entry */
+        *time = g_get_real_time();
+    } else {
+        return FALSE;
+    }
+    lw->indexed = TRUE;
+    return TRUE;
+}
+
+static void logwriter_index_add(GArray *index, gint64 time, guint64 offset)
+{
+    struct logwriter_index rec = {
+        .time   = GUINT64_TO_LE(time),
+        .offset = GUINT64_TO_LE(offset),
+    };
+
+    g_array_append_val(index, rec);
+}
+
+static void logwriter_index_write(struct logwriter *lw, GArray *index)
+{
+    size_t len = index->len * sizeof(struct logwriter_index);
+
+    if (lw->idxfd < 0 || !len)
+        return;
+    if (write(lw->idxfd, index->data, len) != len) {
+        fprintf(stderr, "write %s.idx: %s\n", lw->filename, strerror(errno));
+        close(lw->idxfd);
+        lw->idxfd = -1;
+    }
+}
+
+static void logwriter_file_writev(struct logwriter *lw, GQueue *chunks)
+{
+    struct iovec iov[LOGWRITER_IOV];
+    GByteArray *chunk;
+    GList *item;
+    ssize_t rc;
+    int n;
+
+    while (!g_queue_is_empty(chunks) && !lw->failed) {
+        n = 0;
+        for (item = chunks->head; item && n < LOGWRITER_IOV; item = item->next) {
+            chunk = item->data;
+            iov[n].iov_base = chunk->data;
+            iov[n].iov_len  = chunk->len;
+            n++;
+        }
+        rc = writev(lw->fd, iov, n);
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "write %s: %s\n", lw->filename, strerror(errno));
+            lw->failed = TRUE;
+            break;
+        }
+        /* drop what has been written, trim partially written chunk */
+        lw->size += rc;
+        while (rc > 0) {
+            chunk = g_queue_peek_head(chunks);
+            if (rc >= chunk->len) {
+                rc -= chunk->len;
+                g_byte_array_free(g_queue_pop_head(chunks), TRUE);
+            } else {
+                g_byte_array_remove_range(chunk, 0, rc);
+                rc = 0;
+            }
+        }
+    }
+
+    while (!g_queue_is_empty(chunks))
+        g_byte_array_free(g_queue_pop_head(chunks), TRUE);
+}
+
+static void logwriter_deflate(struct logwriter *lw, GByteArray *out,
+                              const void *buf, size_t len, int flush)
+{
+    z_stream *zs = lw->zs;
+    guint pos;
+
+    zs->next_in = buf;
+    zs->avail_in = len;
+    do {
+        pos = out->len;
+        g_byte_array_set_size(out, pos + LOGWRITER_CHUNK);
+        zs->next_out = out->data + pos;
+        zs->avail_out = LOGWRITER_CHUNK;
+        deflate(zs, flush);
+        g_byte_array_set_size(out, out->len - zs->avail_out);
+    } while (zs->avail_out == 0);
+}
+
+static void logwriter_file_gzip(struct logwriter *lw, GQueue *chunks,
+                                GQueue *marks, GArray *index, gboolean close)
+{
+    GByteArray *chunk, *out;
+    gint64 now, time;
+
+    if (!lw->zs) {
+        lw->zs = g_new0(z_stream, 1);
+        if (deflateInit2(lw->zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                         MAX_WBITS + 16 /* gzip header */, 8,
+                         Z_DEFAULT_STRATEGY) != Z_OK) {
+            fprintf(stderr, "deflateInit %s: failed\n", lw->filename);
+            g_free(lw->zs);
+            lw->zs = NULL;
+            lw->failed = TRUE;
+            logwriter_file_writev(lw, chunks); /* free chunks */
+            return;
+        }
+    }
+
+    out = g_byte_array_sized_new(LOGWRITER_CHUNK);
+    while (!g_queue_is_empty(chunks)) {
+        chunk = g_queue_pop_head(chunks);
+        if (logwriter_index_due(lw, marks, chunk, &time)) {
+            if (lw->zframe) {
+                /* inflate must be able to start at index points */
+                logwriter_deflate(lw, out, NULL, 0, Z_FULL_FLUSH);
+            }
+            logwriter_index_add(index, time, lw->size + out->len);
+        }
+        if (!lw->zframe)
+            lw->zstart = g_get_monotonic_time();
+        logwriter_deflate(lw, out, chunk->data, chunk->len, Z_NO_FLUSH);
+        lw->zframe += chunk->len;
+        g_byte_array_free(chunk, TRUE);
+    }
+
+    if (lw->zframe) {
+        now = g_get_monotonic_time();
+        if (close ||
+            lw->zframe >= LOGWRITER_FRAME ||
+            now - lw->zstart >= LOGWRITER_FRAME_TIME) {
+            /* finish gzip member */
+            logwriter_deflate(lw, out, NULL, 0, Z_FINISH);
+            deflateReset(lw->zs);
+            lw->zframe = 0;
+        } else {
+            logwriter_deflate(lw, out, NULL, 0, Z_SYNC_FLUSH);
+        }
+    }
+
+    if (out->len) {
+        g_queue_push_tail(chunks, out);
+        logwriter_file_writev(lw, chunks);
+    } else {
+        g_byte_array_free(out, TRUE);
+    }
+}
+
+/* returns N for "<prefix>.log.<N>[.gz][.idx]", -1 otherwise (any prefix if NULL) */
+static int logwriter_segment(const char *name, const char *prefix)
+{
+    const char *start, *end;
+    size_t plen;
+
+    end = name + strlen(name);
+    if (g_str_has_suffix(name, ".idx"))
+        end -= strlen(".idx");
+    if (end - name > 3 && strncmp(end - 3, ".gz", 3) == 0)
+        end -= strlen(".gz");
+
+    /* active logs end with ".log", never with digits */
+    start = end;
+    while (start > name && g_ascii_isdigit(start[-1]))
+        start--;
+    if (start == end || start - name <= 5 ||
+        strncmp(start - 5, ".log.", 5) != 0)
+        return -1;
+    plen = start - 5 - name;
+    if (prefix && (plen != strlen(prefix) ||
+                   strncmp(name, prefix, plen) != 0))
+        return -1;
+    return atoi(start);
+}
+
+static int logwriter_next_segment(struct logwriter *lw)
+{
+    char *dirname = g_path_get_dirname(lw->basename);
+    char *prefix = g_path_get_basename(lw->basename);
+    const char *name;
+    GDir *dir;
+    int n, max = 0;
+
+    dir = g_dir_open(dirname, 0, NULL);
+    if (dir) {
+        while ((name = g_dir_read_name(dir)) != NULL) {
+            n = logwriter_segment(name, prefix);
+            if (n > max)
+                max = n;
+        }
+        g_dir_close(dir);
+    }
+    g_free(dirname);
+    g_free(prefix);
+    return max + 1;
+}
+
+static gboolean logwriter_rotate_due(struct logwriter *lw)
+{
+    if (lw->fd < 0 || !lw->size)
+        return FALSE;
+    if (rotate_size && lw->size >= rotate_size)
+        return TRUE;
+    if (rotate_age && time(NULL) - lw->created >= rotate_age)
+        return TRUE;
+    return FALSE;
+}
+
+static void logwriter_file_rotate(struct logwriter *lw)
+{
+    GQueue empty = G_QUEUE_INIT;
+    char *segment, *idxname, *idxsegment;
+
+    if (lw->zs)
+        logwriter_file_gzip(lw, &empty, &empty, NULL, TRUE);
+    logwriter_file_release(lw);
+    lw->created = 0;
+    lw->indexed = FALSE;
+
+    /* reopened by the next write */
+    segment = g_strdup_printf("%s.log.%d%s", lw->basename,
+                              logwriter_next_segment(lw),
+                              segment_suffix[log_format]);
+    if (rename(lw->filename, segment) < 0) {
+        fprintf(stderr, "rename %s: %s\n", lw->filename, strerror(errno));
+    } else {
+        if (debug)
+            fprintf(stderr, "%s: %s\n", __func__, segment);
+        idxname = g_strdup_printf("%s.idx", lw->filename);
+        idxsegment = g_strdup_printf("%s.idx", segment);
+        rename(idxname, idxsegment);
+        g_free(idxname);
+        g_free(idxsegment);
+    }
+    g_free(segment);
+}
+
+/* returns TRUE if the log has been rotated */
+static gboolean logwriter_file_write(struct logwriter *lw, GQueue *chunks,
+                                     GQueue *marks, gboolean close)
+{
+    GArray *index = g_array_new(FALSE, FALSE, sizeof(struct logwriter_index));
+    GByteArray *chunk;
+    guint64 offset;
+    gint64 time;
+    GList *item;
+
+    if (!lw->failed && (!g_queue_is_empty(chunks) || lw->zframe)) {
+        logwriter_file_reserve(lw);
+        if (lw->fd < 0)
+            logwriter_file_open(lw);
+    }
+
+    if (lw->fd < 0) {
+        /* nothing to do, or open failed */
+        logwriter_file_writev(lw, chunks);
+    } else if (log_format == LOGWRITER_FORMAT_GZIP) {
+        logwriter_file_gzip(lw, chunks, marks, index, close);
+    } else {
+        offset = lw->size;
+        for (item = chunks->head; item != NULL; item = item->next) {
+            chunk = item->data;
+            if (logwriter_index_due(lw, marks, chunk, &time))
+                logwriter_index_add(index, time, offset);
+            offset += chunk->len;
+        }
+        logwriter_file_writev(lw, chunks);
+    }
+    if (!lw->failed)
+        logwriter_index_write(lw, index);
+    g_array_free(index, TRUE);
+    while (!g_queue_is_empty(marks))
+        g_free(g_queue_pop_head(marks));
+
+    if (close || !logwriter_rotate_due(lw))
+        return FALSE;
+    logwriter_file_rotate(lw);
+    return TRUE;
+}
+
+static void logwriter_file_close(struct logwriter *lw)
+{
+    if (lw->zs) {
+        deflateEnd(lw->zs);
+        g_free(lw->zs);
+    }
+    logwriter_file_release(lw);
+    g_free(lw->basename);
+    g_free(lw->filename);
+    g_free(lw);
+}
+
+/* ------------------------------------------------------------------ */
+
+struct logwriter_segment {
+    char                      *path;
+    guint64                   size;
+    time_t                    mtime;
+};
+
+static void logwriter_quota_scan(const char *dirname, int depth,
+                                 GArray *segments, guint64 *total)
+{
+    struct logwriter_segment seg;
+    struct stat st;
+    const char *name;
+    char *path;
+    GDir *dir;
+
+    dir = g_dir_open(dirname, 0, NULL);
+    if (!dir)
+        return;
+    while ((name = g_dir_read_name(dir)) != NULL) {
+        path = g_build_filename(dirname, name, NULL);
+        if (lstat(path, &st) < 0) {
+            g_free(path);
+            continue;
+        }
+        if (S_ISDIR(st.st_mode) && depth > 0)
+            logwriter_quota_scan(path, depth - 1, segments, total);
+        if (S_ISREG(st.st_mode)) {
+            *total += st.st_size;
+            if (logwriter_segment(name, NULL) >= 0) {
+                seg.path = path;
+                seg.size = st.st_size;
+                seg.mtime = st.st_mtime;
+                g_array_append_val(segments, seg);
+                continue;
+            }
+        }
+        g_free(path);
+    }
+    g_dir_close(dir);
+}
+
+static gint logwriter_segment_cmp(gconstpointer a, gconstpointer b)
+{
+    const struct logwriter_segment *sa = a;
+    const struct logwriter_segment *sb = b;
+
+    if (sa->mtime != sb->mtime)
+        return sa->mtime < sb->mtime ? -1 : 1;
+    return strcmp(sa->path, sb->path);
+}
+
+static gboolean logwriter_is_active(const char *path)
+{
+    struct logwriter *lw;
+    gboolean active = FALSE;
+    GList *item;
+
+    g_mutex_lock(&lock);
+    for (item = logs; item != NULL; item = item->next) {
+        lw = item->data;
+        if (strcmp(lw->filename, path) == 0)
+            active = TRUE;
+    }
+    g_mutex_unlock(&lock);
+    return active;
+}
+
+static void logwriter_quota(void)
+{
+    struct logwriter_segment *seg;
+    GArray *segments;
+    guint64 total = 0;
+    int i;
+
+    if (!quota || !topdir)
+        return;
+
+    segments = g_array_new(FALSE, FALSE, sizeof(struct logwriter_segment));
+    logwriter_quota_scan(topdir, 2, segments, &total);
+    g_array_sort(segments, logwriter_segment_cmp);
+
+    /* delete oldest segments first */
+    for (i = 0; i < segments->len; i++) {
+        seg = &g_array_index(segments, struct logwriter_segment, i);
+        if (total > quota && !logwriter_is_active(seg->path)) {
+            if (unlink(seg->path) == 0) {
+                if (debug)
+                    fprintf(stderr, "%s: rm %s\n", __func__, seg->path);
+                total -= seg->size;
+            } else {
+                fprintf(stderr, "unlink %s: %s\n", seg->path, strerror(errno));
+            }
+        }
+        g_free(seg->path);
+    }
+    g_array_free(segments, TRUE);
+
+    if (total > quota && debug)
+        fprintf(stderr, "%s: over quota, no rotated logs left\n", __func__);
+}
+
+/* ------------------------------------------------------------------ */
+
+struct logwriter_flush {
+    struct logwriter          *lw;
+    GQueue                    chunks;
+    GQueue                    marks;
+    gboolean                  close;
+};
+
+static gpointer logwriter_thread(gpointer data)
+{
+    struct logwriter_flush *flush;
+    struct logwriter *lw;
+    GList *item, *next, *work;
+    gint64 deadline, now, quota_check = 0;
+    gboolean timeout, rotated, done = FALSE;
+    char *msg;
+
+    deadline = g_get_monotonic_time() + sync_interval * G_TIME_SPAN_MILLISECOND;
+    while (!done) {
+        /* wait for work */
+        g_mutex_lock(&lock);
+        while (!kick && !quit) {
+            if (sync_mode == LOGWRITER_SYNC_CLOSE) {
+                g_cond_wait(&cond, &lock);
+            } else if (!g_cond_wait_until(&cond, &lock, deadline)) {
+                break;
+            }
+        }
+        now = g_get_monotonic_time();
+        timeout = (sync_mode != LOGWRITER_SYNC_CLOSE && now >= deadline);
+        done = quit;
+        kick = FALSE;
+
+        /* grab data, the actual i/o happens unlocked */
+        work = NULL;
+        for (item = logs; item != NULL; item = next) {
+            next = item->next;
+            lw = item->data;
+            if (!lw->closing && !done && lw->pending < LOGWRITER_FLUSH &&
+                !(timeout && (lw->pending || lw->dropped)))
+                continue;
+            flush = g_new0(struct logwriter_flush, 1);
+            flush->lw = lw;
+            flush->chunks = lw->chunks;
+            flush->marks = lw->marks;
+            g_queue_init(&lw->chunks);
+            g_queue_init(&lw->marks);
+            if (lw->dropped) {
+                msg = g_strdup_printf("\n*** %s: %" G_GUINT64_FORMAT
+                                      " bytes dropped ***\n",
+                                      appname, lw->dropped);
+                g_queue_push_tail(&flush->chunks,
+                                  g_byte_array_new_take((guint8 *)msg,
+                                                        strlen(msg)));
+                lw->dropped = 0;
+            }
+            lw->pending = 0;
+            if (lw->closing) {
+                flush->close = TRUE;
+                logs = g_list_delete_link(logs, item);
+            }
+            work = g_list_prepend(work, flush);
+        }
+        g_mutex_unlock(&lock);
+
+        /* write */
+        rotated = FALSE;
+        for (item = work; item != NULL; item = item->next) {
+            flush = item->data;
+            if (logwriter_file_write(flush->lw, &flush->chunks, &flush->marks,
+                                     flush->close || done))
+                rotated = TRUE;
+            if (flush->close) {
+                logwriter_file_close(flush->lw);
+            } else if (done) {
+                /* quit, gzip member is finished, struct stays valid */
+                logwriter_file_release(flush->lw);
+            } else if (timeout &&
+                       sync_mode == LOGWRITER_SYNC_FDATASYNC &&
+                       flush->lw->fd >= 0) {
+                fdatasync(flush->lw->fd);
+            }
+            g_free(flush);
+        }
+        g_list_free(work);
+
+        if (rotated || now - quota_check >= LOGWRITER_QUOTA_TIME) {
+            logwriter_quota();
+            quota_check = now;
+        }
+        if (timeout)
+            deadline = now + sync_interval * G_TIME_SPAN_MILLISECOND;
+    }
+    return NULL;
+}
+
+/* ------------------------------------------------------------------ */
+
+int logwriter_sync_parse(const char *name)
+{
+    int i;
+
+    for (i = 0; i < G_N_ELEMENTS(sync_names); i++)
+        if (strcmp(name, sync_names[i]) == 0)
+            return i;
+    return -1;
+}
+
+int logwriter_format_parse(const char *name)
+{
+    int i;
+
+    for (i = 0; i < G_N_ELEMENTS(format_names); i++)
+        if (strcmp(name, format_names[i]) == 0)
+            return i;
+    return -1;
+}
+
+void logwriter_init(const struct logwriter_config *cfg)
+{
+    if (thread)
+        return;
+    sync_mode = cfg->sync;
+    if (cfg->interval > 0)
+        sync_interval = cfg->interval;
+    log_format = cfg->format;
+    rotate_size = cfg->rotate_size;
+    rotate_age = cfg->rotate_age;
+    quota = cfg->quota;
+    topdir = g_strdup(cfg->topdir);
+    max_open = cfg->max_open;
+    appname = g_strdup(cfg->appname ? cfg->appname : "logwriter");
+    if (debug) {
+        fprintf(stderr, "%s: sync %s, interval %d ms, format %s\n", __func__,
+                sync_names[sync_mode], sync_interval, format_names[log_format]);
+        fprintf(stderr, "%s: rotate %" G_GUINT64_FORMAT " bytes / %d s,"
+                " quota %" G_GUINT64_FORMAT " bytes\n", __func__,
+                rotate_size, rotate_age, quota);
+    }
+    thread = g_thread_new("logwriter", logwriter_thread, NULL);
+}
+
+void logwriter_fini(void)
+{
+    if (!thread)
+        return;
+    g_mutex_lock(&lock);
+    quit = TRUE;
+    g_cond_signal(&cond);
+    g_mutex_unlock(&lock);
+    g_thread_join(thread);
+    thread = NULL;
+}
+
+struct logwriter *logwriter_open(const char *basename)
+{
+    struct logwriter *lw;
+
+    lw = g_new0(struct logwriter, 1);
+    lw->basename = g_strdup(basename);
+    lw->filename = g_strdup_printf("%s%s", basename, format_suffix[log_format]);
+    lw->fd = -1;
+    lw->idxfd = -1;
+    lw->lru.data = lw;
+    g_queue_init(&lw->chunks);
+    g_queue_init(&lw->marks);
+
+    g_mutex_lock(&lock);
+    logs = g_list_prepend(logs, lw);
+    g_mutex_unlock(&lock);
+    return lw;
+}
+
+const char *logwriter_filename(struct logwriter *lw)
+{
+    return lw->filename;
+}
+
+void logwriter_write(struct logwriter *lw, const void *buf, size_t len)
+{
+    struct logwriter_mark *mark;
+    GByteArray *chunk;
+    gint64 now, slot;
+
+    now = g_get_real_time();
+    slot = now / (LOGWRITER_INDEX_TIME * G_TIME_SPAN_SECOND);
+
+    g_mutex_lock(&lock);
+    if (lw->pending + len > LOGWRITER_MAX) {
+        /* writer can't keep up, drop data */
+        lw->dropped += len;
+        goto out;
+    }
+    chunk = g_queue_peek_tail(&lw->chunks);
+    if (!chunk || chunk->len + len > LOGWRITER_CHUNK || slot != lw->slot) {
+        /* new slot needs a new chunk, the index mark points to it */
+        chunk = g_byte_array_sized_new(len);
+        g_queue_push_tail(&lw->chunks, chunk);
+    }
+    if (slot != lw->slot) {
+        mark = g_new0(struct logwriter_mark, 1);
+        mark->chunk = chunk;
+        mark->time = now;
+        g_queue_push_tail(&lw->marks, mark);
+        lw->slot = slot;
+    }
+    g_byte_array_append(chunk, buf, len);
+    lw->pending += len;
+    if (lw->pending >= LOGWRITER_FLUSH) {
+        kick = TRUE;
+        g_cond_signal(&cond);
+    }
+out:
+    g_mutex_unlock(&lock);
+}
+
+void logwriter_close(struct logwriter *lw)
+{
+    g_mutex_lock(&lock);
+    lw->closing = TRUE;
+    kick = TRUE;
+    g_cond_signal(&cond);
+    g_mutex_unlock(&lock);
+}
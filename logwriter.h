@@ -0,0 +1,54 @@
+#include <glib.h>
+
+enum logwriter_sync {
+    LOGWRITER_SYNC_CLOSE,      /* write when buffers fill up and on close */
+    LOGWRITER_SYNC_INTERVAL,   /* write every interval ms */
+    LOGWRITER_SYNC_FDATASYNC,  /* write + fdatasync every interval ms */
+};
+
+enum logwriter_format {
+    LOGWRITER_FORMAT_PLAIN,    /* <name>.log */
+    LOGWRITER_FORMAT_GZIP,     /* <name>.log.gz, one gzip member per frame */
+};
+
+struct logwriter_config {
+    enum logwriter_sync       sync;
+    int                       interval;     /* ms */
+    enum logwriter_format     format;
+    guint64                   rotate_size;  /* bytes, 0 = no limit */
+    int                       rotate_age;   /* seconds, 0 = no limit */
+    guint64                   quota;        /* bytes, 0 = no limit */
+    const char                *topdir;      /* quota applies to this tree */
+    int                       max_open;     /* open log files, 0 = no limit */
+    const char                *appname;     /* for markers in the log */
+};
+
+/*
+ * <logfile>.idx: LOGWRITER_INDEX_MAGIC header, padded to 16 bytes, then
+ * one record every LOGWRITER_INDEX_TIME seconds with console output,
+ * sorted by time.  In gzip logs every offset is either the start of a
+ * gzip member or a full flush point within one, where raw deflate
+ * (no gzip header) decompression can start.
+ */
+#define LOGWRITER_INDEX_MAGIC   "vconidx1"
+#define LOGWRITER_INDEX_HEADER  16
+#define LOGWRITER_INDEX_TIME    10
+
+struct logwriter_index {
+    guint64                   time;         /* us since epoch, little endian */
+    guint64                   offset;       /* file offset, little endian */
+};
+
+struct logwriter;
+
+/* setup and shutdown, fini flushes everything still queued */
+void logwriter_init(const struct logwriter_config *cfg);
+void logwriter_fini(void);
+int logwriter_sync_parse(const char *name);
+int logwriter_format_parse(const char *name);
+
+/* per log file, never blocks on disk i/o */
+struct logwriter *logwriter_open(const char *basename);
+const char *logwriter_filename(struct logwriter *lw);
+void logwriter_write(struct logwriter *lw, const void *buf, size_t len);
+void logwriter_close(struct logwriter *lw);
@@ -28,6 +28,56 @@ static void config_read(void)
                               G_KEY_FILE_KEEP_COMMENTS, &err);
 }
 
+static void logging_init(void)
+{
+    struct logwriter_config cfg = {
+        .sync    = LOGWRITER_SYNC_INTERVAL,
+        .format  = LOGWRITER_FORMAT_PLAIN,
+        .appname = APPNAME,
+    };
+    GError *err = NULL;
+    char *name, *topdir;
+    int rc;
+
+    name = g_key_file_get_string(config, "vm", "logsync", &err);
+    if (name) {
+        rc = logwriter_sync_parse(name);
+        if (rc < 0)
+            fprintf(stderr, "unknown logsync mode: %s\n", name);
+        else
+            cfg.sync = rc;
+        g_free(name);
+    }
+    err = NULL;
+    cfg.interval = g_key_file_get_integer(config, "vm", "logsync-interval", &err);
+    err = NULL;
+    name = g_key_file_get_string(config, "vm", "logformat", &err);
+    if (name) {
+        rc = logwriter_format_parse(name);
+        if (rc < 0)
+            fprintf(stderr, "unknown logformat: %s\n", name);
+        else
+            cfg.format = rc;
+        g_free(name);
+    }
+
+    /* sizes are in megabytes, age is in hours */
+    err = NULL;
+    cfg.rotate_size = g_key_file_get_uint64(config, "vm", "logrotate-size", &err)
+        * 1024 * 1024;
+    err = NULL;
+    cfg.rotate_age = g_key_file_get_integer(config, "vm", "logrotate-age", &err)
+        * 60 * 60;
+    err = NULL;
+    cfg.quota = g_key_file_get_uint64(config, "vm", "logquota", &err)
+        * 1024 * 1024;
+
+    topdir = g_strdup_printf("%s/vconsole", getenv("HOME"));
+    cfg.topdir = topdir;
+    logwriter_init(&cfg);
+    g_free(topdir);
+}
+
 void config_write(void)
 {
     char *data;
@@ -98,6 +148,89 @@ void gtk_message(GtkWidget *parent, GtkWidget **dialog, GtkMessageType type,
     }
 }
 
+/*
+ * Bulk load mode for the guest list.  Inserting rows into a sorted
+ * store attached to a tree view means a re-sort, reorder signal and
+ * view update per row.  So detach the view and switch off sorting
+ * while filling in many rows, then sort once and reattach.  Expanded
+ * rows and the selection are restored afterwards.
+ */
+static void tree_save_expanded(GtkTreeView *tree, GtkTreePath *path,
+                               gpointer data)
+{
+    struct vconsole_window *win = data;
+
+    win->bulk_expanded = g_slist_prepend
+        (win->bulk_expanded,
+         gtk_tree_row_reference_new(GTK_TREE_MODEL(win->store), path));
+}
+
+void tree_bulk_begin(struct vconsole_window *win)
+{
+    GtkTreeView *tree = GTK_TREE_VIEW(win->tree);
+    GtkTreeSelection *select;
+    GtkTreeModel *model;
+    GtkTreeIter iter;
+    GtkTreePath *path;
+
+    if (win->bulk++)
+        return;
+
+    gtk_tree_view_map_expanded_rows(tree, tree_save_expanded, win);
+    select = gtk_tree_view_get_selection(tree);
+    if (gtk_tree_selection_get_selected(select, &model, &iter)) {
+        path = gtk_tree_model_get_path(model, &iter);
+        win->bulk_selected = gtk_tree_row_reference_new(model, path);
+        gtk_tree_path_free(path);
+    }
+    gtk_tree_sortable_get_sort_column_id(GTK_TREE_SORTABLE(win->store),
+                                         &win->bulk_sort_col,
+                                         &win->bulk_sort_order);
+    gtk_tree_view_set_model(tree, NULL);
+    gtk_tree_sortable_set_sort_column_id(GTK_TREE_SORTABLE(win->store),
+                                         GTK_TREE_SORTABLE_UNSORTED_SORT_COLUMN_ID,
+                                         GTK_SORT_ASCENDING);
+}
+
+void tree_bulk_end(struct vconsole_window *win)
+{
+    GtkTreeView *tree = GTK_TREE_VIEW(win->tree);
+    GtkTreeRowReference *row;
+    GtkTreePath *path;
+    GSList *item;
+
+    if (--win->bulk)
+        return;
+
+    gtk_tree_sortable_set_sort_column_id(GTK_TREE_SORTABLE(win->store),
+                                         win->bulk_sort_col,
+                                         win->bulk_sort_order);
+    gtk_tree_view_set_model(tree, GTK_TREE_MODEL(win->store));
+
+    for (item = win->bulk_expanded; item != NULL; item = item->next) {
+        row = item->data;
+        path = gtk_tree_row_reference_get_path(row);
+        if (path) {
+            gtk_tree_view_expand_row(tree, path, FALSE);
+            gtk_tree_path_free(path);
+        }
+        gtk_tree_row_reference_free(row);
+    }
+    g_slist_free(win->bulk_expanded);
+    win->bulk_expanded = NULL;
+
+    if (win->bulk_selected) {
+        path = gtk_tree_row_reference_get_path(win->bulk_selected);
+        if (path) {
+            gtk_tree_selection_select_path
+                (gtk_tree_view_get_selection(tree), path);
+            gtk_tree_path_free(path);
+        }
+        gtk_tree_row_reference_free(win->bulk_selected);
+        win->bulk_selected = NULL;
+    }
+}
+
 static int gtk_getstring(GtkWidget *window, char *title, char *message,
                          char *dest, int dlen)
 {
@@ -497,6 +630,89 @@ static void menu_cb_vm_gfx(GSimpleAction *action,
         run_virt_viewer(dom, true);
 }
 
+static GtkWidget *sendfile_spin(GtkWidget *grid, int row, const char *label,
+                                double max, const char *key)
+{
+    GtkWidget *spin;
+
+    spin = gtk_spin_button_new_with_range(0, max, 1);
+    gtk_spin_button_set_value(GTK_SPIN_BUTTON(spin),
+                              g_key_file_get_integer(config, "vm", key, NULL));
+    gtk_grid_attach(GTK_GRID(grid), gtk_label_new(label), 0, row, 1, 1);
+    gtk_grid_attach(GTK_GRID(grid), spin, 1, row, 1, 1);
+    return spin;
+}
+
+static void menu_cb_vm_sendfile(GSimpleAction *action,
+                                GVariant      *parameter,
+                                gpointer       data)
+{
+    struct vconsole_window *win = data;
+    struct vconsole_domain *dom = find_guest(win);
+    GtkWidget *dialog, *grid, *rate, *delay, *echo;
+    unsigned int r, d;
+    gboolean e;
+    char *filename, *msg;
+
+    if (!dom)
+        return;
+    if (dom->sendfile) {
+        msg = g_strdup_printf("Cancel sending %s\nto %s?",
+                              dom->sendfile->filename, dom->name);
+        if (gtk_yesno(win->toplevel, "Please confirm", msg))
+            domain_sendfile_cancel(dom);
+        g_free(msg);
+        return;
+    }
+    if (!dom->console.stream) {
+        gtk_message(win->toplevel, NULL, GTK_MESSAGE_ERROR,
+                    "Console of %s is not connected\n", dom->name);
+        return;
+    }
+
+    dialog = gtk_file_chooser_dialog_new("Send file to console",
+                                         GTK_WINDOW(win->toplevel),
+                                         GTK_FILE_CHOOSER_ACTION_OPEN,
+                                         "_Cancel", GTK_RESPONSE_CANCEL,
+                                         "_Send",   GTK_RESPONSE_ACCEPT,
+                                         NULL);
+    grid = gtk_grid_new();
+    gtk_grid_set_row_spacing(GTK_GRID(grid), 5);
+    gtk_grid_set_column_spacing(GTK_GRID(grid), 10);
+    rate  = sendfile_spin(grid, 0, "Rate limit (bytes/s, 0 = off)",
+                          10 * 1024 * 1024, "sendfile-rate");
+    delay = sendfile_spin(grid, 1, "Delay after each line (ms)",
+                          10000, "sendfile-line-delay");
+    echo  = gtk_check_button_new_with_label("Wait for the guest to echo each line");
+    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(echo),
+                                 g_key_file_get_boolean(config, "vm",
+                                                        "sendfile-echo", NULL));
+    gtk_grid_attach(GTK_GRID(grid), echo, 0, 2, 2, 1);
+    gtk_widget_show_all(grid);
+    gtk_file_chooser_set_extra_widget(GTK_FILE_CHOOSER(dialog), grid);
+
+    if (gtk_dialog_run(GTK_DIALOG(dialog)) != GTK_RESPONSE_ACCEPT) {
+        gtk_widget_destroy(dialog);
+        return;
+    }
+    filename = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(dialog));
+    r = gtk_spin_button_get_value_as_int(GTK_SPIN_BUTTON(rate));
+    d = gtk_spin_button_get_value_as_int(GTK_SPIN_BUTTON(delay));
+    e = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(echo));
+    gtk_widget_destroy(dialog);
+
+    g_key_file_set_integer(config, "vm", "sendfile-rate", r);
+    g_key_file_set_integer(config, "vm", "sendfile-line-delay", d);
+    g_key_file_set_boolean(config, "vm", "sendfile-echo", e);
+    config_write();
+
+    if (domain_sendfile_start(dom, filename, r, d, e) < 0)
+        gtk_message(win->toplevel, NULL, GTK_MESSAGE_ERROR,
+                    "Can't send %s: %s\n", filename,
+                    dom->console.stream ? strerror(errno) : "not connected");
+    g_free(filename);
+}
+
 static void menu_cb_vm_run(GSimpleAction *action,
                            GVariant      *parameter,
                            gpointer       data)
@@ -701,6 +917,9 @@ static const GActionEntry entries[] = {
     },{
 	.name        = "GuestGfx",
 	.activate    = menu_cb_vm_gfx,
+    },{
+	.name        = "GuestSendFile",
+	.activate    = menu_cb_vm_sendfile,
     },{
 	.name        = "GuestRun",
 	.activate    = menu_cb_vm_run,
@@ -752,6 +971,33 @@ static void window_destroy(GtkWidget *widget, gpointer data)
     gtk_main_quit();
 }
 
+static gboolean window_state(GtkWidget *widget, GdkEventWindowState *event,
+                             gpointer data)
+{
+    struct vconsole_window *win = data;
+    struct vconsole_domain *dom;
+
+    win->iconified = event->new_window_state & GDK_WINDOW_STATE_ICONIFIED;
+    if (!win->iconified) {
+        dom = domain_find_current_tab(win);
+        if (dom)
+            domain_flush_deferred(dom);
+    }
+    return FALSE;
+}
+
+static void notebook_switch_page(GtkNotebook *notebook, GtkWidget *page,
+                                 guint page_num, gpointer data)
+{
+    struct vconsole_window *win = data;
+    struct vconsole_domain *dom;
+
+    dom = g_object_get_data(G_OBJECT(page), "vconsole-domain");
+    if (dom)
+        domain_flush_deferred(dom);
+    domain_scrollback_rebalance(win);
+}
+
 static void vconsole_build_recent(struct vconsole_window *win)
 {
     GError *err = NULL;
@@ -793,6 +1039,8 @@ static struct vconsole_window *vconsole_toplevel_create(void)
     gtk_builder_add_callback_symbols
         (builder,
          "window-destroy", G_CALLBACK(window_destroy),
+         "window-state", G_CALLBACK(window_state),
+         "notebook-switch-page", G_CALLBACK(notebook_switch_page),
          NULL);
     gtk_builder_connect_signals(builder, win);
 
@@ -815,7 +1063,26 @@ static struct vconsole_window *vconsole_toplevel_create(void)
     err = NULL;
     win->tty_blink = g_key_file_get_boolean(config, "tty", "blink", &err);
     err = NULL;
+    win->tty_defer = g_key_file_get_boolean(config, "tty", "defer-hidden", &err);
+    err = NULL;
+    win->tty_defer_limit = g_key_file_get_integer(config, "tty", "defer-limit",
+                                                  &err) * 1024;
+    err = NULL;
+    win->tty_scrollback = g_key_file_get_integer(config, "tty", "scrollback",
+                                                 &err);
+    err = NULL;
     win->vm_logging = g_key_file_get_boolean(config, "vm", "logging", &err);
+    err = NULL;
+    win->vm_history = g_key_file_get_boolean(config, "vm", "history", &err);
+    err = NULL;
+    win->history_size = g_key_file_get_integer(config, "vm", "history-size",
+                                               &err) * 1024;
+    err = NULL;
+    win->history_budget = g_key_file_get_integer(config, "vm", "history-budget",
+                                                 &err) * 1024 * 1024;
+    err = NULL;
+    win->event_thread = g_key_file_get_boolean(config, "vm", "event-thread",
+                                               &err);
 
     /* config defaults */
     if (!win->tty_font)
@@ -824,6 +1091,14 @@ static struct vconsole_window *vconsole_toplevel_create(void)
         win->tty_fg = "white";
     if (!win->tty_bg)
         win->tty_bg = "black";
+    if (!win->tty_scrollback)
+        win->tty_scrollback = 100000;
+    if (!win->tty_defer_limit)
+        win->tty_defer_limit = 256 * 1024;
+    if (!win->history_size)
+        win->history_size = 64 * 1024;
+    if (!win->history_budget)
+        win->history_budget = 64 * 1024 * 1024;
 
     /* apply config */
     gtk_check_menu_item_set_active(win->blinking, win->tty_blink);
@@ -841,7 +1116,8 @@ static void vconsole_tab_list_activate(GtkTreeView *tree_view,
     GtkTreeModel *model = GTK_TREE_MODEL(win->store);
     GtkTreeIter parent, iter;
     gboolean is_host;
-    char *name;
+    char *name, *msg;
+    struct vconsole_connect *conn;
     struct vconsole_domain *dom;
 
     if (!gtk_tree_model_get_iter(model, &iter, path))
@@ -851,7 +1127,15 @@ static void vconsole_tab_list_activate(GtkTreeView *tree_view,
     if (is_host) {
         if (debug)
             fprintf(stderr, "%s: host %s\n", __func__, name);
-        if (gtk_tree_view_row_expanded(tree_view, path)) {
+        gtk_tree_model_get(model, &iter, CPTR_COL, &conn, -1);
+        if (!conn->ptr) {
+            msg = g_strdup_printf("Cancel connecting to\n%s?", name);
+            /* connect might have finished while the dialog was up */
+            if (gtk_yesno(win->toplevel, "Please confirm", msg) &&
+                g_hash_table_contains(win->hosts, conn) && !conn->ptr)
+                connect_cancel(conn);
+            g_free(msg);
+        } else if (gtk_tree_view_row_expanded(tree_view, path)) {
             gtk_tree_view_collapse_row(tree_view, path);
         } else {
             gtk_tree_view_expand_row(tree_view, path, FALSE);
@@ -865,28 +1149,62 @@ static void vconsole_tab_list_activate(GtkTreeView *tree_view,
     g_free(name);
 }
 
-static gint gtk_sort_iter_compare_str(GtkTreeModel *model,
-                                      GtkTreeIter  *a,
-                                      GtkTreeIter  *b,
-                                      gpointer      userdata)
+/*
+ * Sorting uses the values cached in the host and guest structs (name
+ * collation keys, see domain_update_tree_store()), so comparing two
+ * rows doesn't allocate.  Hosts are always sorted by name, guests by
+ * the selected column with the name as tie breaker.
+ */
+static const char *gtk_sort_iter_key(GtkTreeModel *model, GtkTreeIter *iter,
+                                     struct vconsole_domain **dom)
 {
-    gint sortcol = GPOINTER_TO_INT(userdata);
-    char *aa,*bb;
-    int ret;
+    struct vconsole_connect *conn;
+
+    gtk_tree_model_get(model, iter, DPTR_COL, dom, CPTR_COL, &conn, -1);
+    if (*dom)
+        return (*dom)->rowcache.sortkey;
+    if (conn)
+        return conn->sortkey;
+    return NULL;
+}
 
-    gtk_tree_model_get(model, a, sortcol, &aa, -1);
-    gtk_tree_model_get(model, b, sortcol, &bb, -1);
-    if (NULL == aa && NULL == bb) {
+static gint gtk_sort_iter_compare(GtkTreeModel *model,
+                                  GtkTreeIter  *a,
+                                  GtkTreeIter  *b,
+                                  gpointer      userdata)
+{
+    gint sortcol = GPOINTER_TO_INT(userdata);
+    struct vconsole_domain *da, *db;
+    const char *ka, *kb;
+    int ret = 0;
+
+    ka = gtk_sort_iter_key(model, a, &da);
+    kb = gtk_sort_iter_key(model, b, &db);
+    if (da && db) {
+        switch (sortcol) {
+        case STATE_COL:
+            ret = da->rowcache.state - db->rowcache.state;
+            break;
+        case LOAD_STR_COL:
+            ret = da->rowcache.load - db->rowcache.load;
+            break;
+        case MEMORY_COL:
+            ret = (da->rowcache.memory > db->rowcache.memory) -
+                (da->rowcache.memory < db->rowcache.memory);
+            break;
+        }
+        if (ret)
+            return ret;
+    }
+    if (NULL == ka && NULL == kb) {
         ret = 0;
-    } else if (NULL == aa) {
+    } else if (NULL == ka) {
         ret = 1;
-    } else if (NULL == bb) {
+    } else if (NULL == kb) {
         ret = -1;
     } else {
-        ret = strcmp(aa,bb);
+        ret = strcmp(ka, kb);
     }
-    g_free(aa);
-    g_free(bb);
     return ret;
 }
 
@@ -915,6 +1233,8 @@ static void vconsole_tab_list_create(struct vconsole_window *win)
                                     G_TYPE_STRING,   // FOREGROUND_COL
                                     G_TYPE_INT);     // WEIGHT_COL
     sortable = GTK_TREE_SORTABLE(win->store);
+    win->hosts = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+                                       g_free);
     win->tree = gtk_tree_view_new_with_model(GTK_TREE_MODEL(win->store));
 
     g_signal_connect(G_OBJECT(win->tree), "row-activated",
@@ -931,7 +1251,7 @@ static void vconsole_tab_list_create(struct vconsole_window *win)
                                                       NULL);
     gtk_tree_view_append_column(GTK_TREE_VIEW(win->tree), column);
     gtk_tree_sortable_set_sort_func(sortable, NAME_COL,
-                                    gtk_sort_iter_compare_str,
+                                    gtk_sort_iter_compare,
                                     GINT_TO_POINTER(NAME_COL), NULL);
     gtk_tree_view_column_set_sort_column_id(column, NAME_COL);
 
@@ -953,6 +1273,10 @@ static void vconsole_tab_list_create(struct vconsole_window *win)
                                                       "text", STATE_COL,
                                                       NULL);
     gtk_tree_view_append_column(GTK_TREE_VIEW(win->tree), column);
+    gtk_tree_sortable_set_sort_func(sortable, STATE_COL,
+                                    gtk_sort_iter_compare,
+                                    GINT_TO_POINTER(STATE_COL), NULL);
+    gtk_tree_view_column_set_sort_column_id(column, STATE_COL);
 
     /* memory */
     renderer = gtk_cell_renderer_text_new();
@@ -963,6 +1287,10 @@ static void vconsole_tab_list_create(struct vconsole_window *win)
                                                       "visible", HAS_MEMCPU_COL,
                                                       NULL);
     gtk_tree_view_append_column(GTK_TREE_VIEW(win->tree), column);
+    gtk_tree_sortable_set_sort_func(sortable, MEMORY_COL,
+                                    gtk_sort_iter_compare,
+                                    GINT_TO_POINTER(MEMORY_COL), NULL);
+    gtk_tree_view_column_set_sort_column_id(column, MEMORY_COL);
 
     /* cpu count */
     renderer = gtk_cell_renderer_text_new();
@@ -984,6 +1312,10 @@ static void vconsole_tab_list_create(struct vconsole_window *win)
                                                       "visible", IS_RUNNING_COL,
                                                       NULL);
     gtk_tree_view_append_column(GTK_TREE_VIEW(win->tree), column);
+    gtk_tree_sortable_set_sort_func(sortable, LOAD_STR_COL,
+                                    gtk_sort_iter_compare,
+                                    GINT_TO_POINTER(LOAD_STR_COL), NULL);
+    gtk_tree_view_column_set_sort_column_id(column, LOAD_STR_COL);
 
     /* padding */
     renderer = gtk_cell_renderer_text_new();
@@ -1085,11 +1417,15 @@ main(int argc, char *argv[])
         uri = getenv("VIRSH_DEFAULT_CONNECT_URI");
 
     /* init */
-    gvir_event_register();
     config_read();
+    logging_init();
 
     /* main window */
     win = vconsole_toplevel_create();
+    if (win->event_thread)
+        gvir_event_register_thread();
+    else
+        gvir_event_register();
     vconsole_tab_list_create(win);
     gtk_widget_show_all(win->toplevel);
     gtk_widget_grab_focus(win->notebook);
@@ -1099,11 +1435,12 @@ main(int argc, char *argv[])
         connect_init(win, uri);
     vconsole_build_recent(win);
 
-    g_timeout_add(10 * 1000, vconsole_update, win);
+    g_timeout_add_seconds(POLL_TICK, vconsole_update, win);
 
     /* main loop */
     gtk_main();
 
     /* cleanup */
+    logwriter_fini();
     exit(0);
 }
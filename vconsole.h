@@ -17,6 +17,9 @@
 #include <libvirt/libvirt.h>
 #include <libvirt/virterror.h>
 
+#include "console.h"
+#include "logwriter.h"
+
 /* ------------------------------------------------------------------ */
 
 enum vconsole_cols {
@@ -65,14 +68,35 @@ struct vconsole_window {
     /* domain list tab */
     GtkTreeStore              *store;
     GtkWidget                 *tree;
+    GHashTable                *hosts;  // vconsole_connect -> host row
+
+    /* guest list bulk load, see tree_bulk_begin() */
+    int                       bulk;
+    gint                      bulk_sort_col;
+    GtkSortType               bulk_sort_order;
+    GSList                    *bulk_expanded;
+    GtkTreeRowReference       *bulk_selected;
 
     /* options */
     gboolean                  tty_blink;
     char                      *tty_font;
     char                      *tty_fg;
     char                      *tty_bg;
+    gboolean                  tty_defer;       /* buffer hidden tabs */
+    size_t                    tty_defer_limit;
+    glong                     tty_scrollback;  /* lines, all terminals */
     gboolean                  vm_logging;
+    gboolean                  vm_history;
+    size_t                    history_size;    /* per guest */
+    size_t                    history_budget;  /* all guests */
+    int                       history_rings;
+    guint                     history_rebalance; /* idle source */
     gboolean                  darkmode;
+    gboolean                  iconified;
+
+    /* libvirt events in their own thread, see domain_flush_rings() */
+    gboolean                  event_thread;
+    gint                      flush_pending;
 };
 
 extern int debug;
@@ -81,36 +105,125 @@ extern GKeyFile *config;
 void gtk_message(GtkWidget *parent, GtkWidget **dialog, GtkMessageType type,
                 char *fmt, ...)
     __attribute__ ((format (printf, 4, 0)));
+void tree_bulk_begin(struct vconsole_window *win);
+void tree_bulk_end(struct vconsole_window *win);
 
 void config_write(void);
 
 /* ------------------------------------------------------------------ */
 
+#define CONNECT_EVENT_IDS 4
+
 struct vconsole_connect {
     struct vconsole_window    *win;
-    virConnectPtr             ptr;
+    guint                     id;       // libvirt callback opaque
+    virConnectPtr             ptr;      // NULL while connecting
+    int                       event_ids[CONNECT_EVENT_IDS];
+    GQueue                    early;    // events while connecting
+    GCancellable              *cancel;
     GtkWidget                 *warn;
     GtkWidget                 *err;
     GtkWidget                 *info;
+    GHashTable                *domains;  // uuid -> vconsole_domain
+    char                      *sortkey;  // collation key of host name
     gboolean                  cap_migration;
     gboolean                  cap_start_paused;
     gboolean                  cap_console_force;
+    gboolean                  cap_bulk_stats;
+    gint64                    poll_cost;  // us, per poll tick
+    GThreadPool               *actions;  // guest actions, one thread
 };
 
 struct vconsole_connect *connect_init(struct vconsole_window *win,
                                       const char *uri);
 void connect_close(virConnectPtr c, int reason, void *opaque);
+void connect_cancel(struct vconsole_connect *conn);
 
 /* ------------------------------------------------------------------ */
 
+/* file upload to the guest console, paced */
+struct domain_sendfile {
+    char                      *filename;
+    int                       fd;
+    off_t                     size;
+    off_t                     sent;
+    gint64                    start;     /* monotonic, us */
+    gint64                    next;      /* don't send before */
+    gint64                    status;    /* last status line update */
+    guint                     timer;
+
+    /* pacing, zero means off */
+    unsigned int              rate;      /* bytes/s */
+    unsigned int              line_delay; /* ms */
+    gboolean                  echo;
+    gboolean                  echo_wait;
+
+    char                      buf[4096];
+    size_t                    pos, len;
+    gboolean                  eof;
+};
+
+/* guest action, runs in the connection worker, see domain_action_queue() */
+enum domain_action_type {
+    DOMAIN_ACTION_START,
+    DOMAIN_ACTION_PAUSE,
+    DOMAIN_ACTION_SAVE,
+    DOMAIN_ACTION_REBOOT,
+    DOMAIN_ACTION_SHUTDOWN,
+    DOMAIN_ACTION_RESET,
+    DOMAIN_ACTION_KILL,
+    DOMAIN_ACTION_UNDEFINE,
+};
+
+struct domain_action {
+    enum domain_action_type   type;
+    struct vconsole_connect   *conn;
+    GCancellable              *cancel;   /* host gone when cancelled */
+    virDomainPtr              d;
+    char                      uuid[VIR_UUID_STRING_BUFLEN];
+    uint32_t                  flags;
+    gboolean                  start_paused;
+    gboolean                  long_job;  /* poll job progress */
+
+    /* written by the worker */
+    gint                      running;
+    gboolean                  started_paused;
+    int                       rc;
+    char                      *error;
+
+    /* job progress, see domain_action_progress_thread() */
+    GMutex                    lock;
+    GCond                     cond;      /* signalled when done */
+    gint                      progress;  /* percent, -1 if unknown */
+    guint                     timer;     /* gtk thread only */
+};
+
+/* guest list row as last written, see domain_update_tree_store() */
+struct domain_row_cache {
+    gboolean                  valid;
+    char                      *name;
+    char                      *sortkey;  /* collation key of name */
+    int                       id;
+    int                       state;
+    int                       nr_cpus;
+    int                       load;
+    int                       avgload;
+    unsigned long             memory;    /* MB */
+    const char                *foreground;
+    int                       weight;
+};
+
 struct vconsole_domain {
     struct vconsole_connect   *conn;
+    virDomainPtr              d;
     char                      uuid[VIR_UUID_STRING_BUFLEN];
+    GtkTreeIter               row;       /* store iters persist */
+    struct domain_row_cache   rowcache;
     int                       id;
     char                      *name;
 
     GtkWidget                 *window, *vbox, *vte, *status;
-    virStreamPtr              stream;
+    struct console            console;
     virDomainInfo             info;
     gboolean                  saved;
     gboolean                  unpause;
@@ -119,9 +232,38 @@ struct vconsole_domain {
     struct timeval            last_ts;
     virDomainInfo             last_info;
     int                       load;
+    gint64                    poll_next;  /* monotonic, us */
 
-    FILE                      *logfp;
+    /* console receive statistics */
+    uint64_t                  rx_last_bytes;
+    uint64_t                  rx_last_chunks;
+    uint64_t                  rx_last_wakeups;
+    uint64_t                  rx_rate;
+    unsigned int              rx_chunks_per_wakeup; /* x10 */
+
+    struct logwriter          *log;
     char                      *logname;
+
+    /* recent console output, also without tab */
+    struct console_ring       history;
+
+    /* output held back while the terminal is not visible */
+    struct console_ring       deferred;
+    size_t                    deferred_bytes;
+    gboolean                  iconified;
+
+    /* share of the scrollback budget */
+    glong                     scrollback;
+
+    struct domain_sendfile    *sendfile;
+
+    /* last queued action and result of the last finished one */
+    struct domain_action      *action;
+    char                      *action_result;
+
+    /* console data from the event thread, see domain_flush_rings() */
+    struct console_spsc       rxring;
+    gint                      rx_hangup;
 };
 
 void domain_untabify(struct vconsole_domain *dom);
@@ -137,11 +279,33 @@ void domain_undefine(struct vconsole_domain *dom);
 
 void domain_free(struct vconsole_domain *dom);
 void domain_update(struct vconsole_connect *conn,
-                   virDomainPtr d, virDomainEventType event);
+                   virDomainPtr d, virDomainEventType event, int detail);
+void domain_event_reboot(struct vconsole_connect *conn, virDomainPtr d);
+void domain_event_balloon(struct vconsole_connect *conn, virDomainPtr d,
+                          unsigned long long actual);
+void domain_event_job_completed(struct vconsole_connect *conn,
+                                virDomainPtr d);
+void domain_add(struct vconsole_connect *conn, virDomainPtr d,
+                virDomainInfo *info, gboolean saved);
+#if LIBVIR_VERSION_NUMBER >= 1002008 /* 1.2.8 */
+#define DOMAIN_STATS (VIR_DOMAIN_STATS_STATE |          \
+                      VIR_DOMAIN_STATS_CPU_TOTAL |      \
+                      VIR_DOMAIN_STATS_BALLOON |        \
+                      VIR_DOMAIN_STATS_VCPU)
+void domain_stats_info(virDomainStatsRecordPtr rec, virDomainInfo *info);
+#endif
 void domain_activate(struct vconsole_domain *dom);
+void domain_flush_deferred(struct vconsole_domain *dom);
+void domain_scrollback_rebalance(struct vconsole_window *win);
+int domain_sendfile_start(struct vconsole_domain *dom, const char *filename,
+                          unsigned int rate, unsigned int line_delay,
+                          gboolean echo);
+void domain_sendfile_cancel(struct vconsole_domain *dom);
 void domain_configure_all_vtes(struct vconsole_window *win);
 void domain_configure_all_logging(struct vconsole_window *win);
 struct vconsole_domain *domain_find_current_tab(struct vconsole_window *win);
 void domain_close_current_tab(struct vconsole_window *win);
 
+#define POLL_TICK 1  /* seconds */
+void domain_poll_soon(struct vconsole_domain *dom);
 void domain_update_all(struct vconsole_window *win);
@@ -14,6 +14,8 @@ BuildRequires: pkgconfig(gtk+-3.0)
 BuildRequires: pkgconfig(libvirt)
 BuildRequires: pkgconfig(libxml-2.0)
 BuildRequires: pkgconfig(vte-2.91)
+BuildRequires: pkgconfig(zlib)
+BuildRequires: systemd-rpm-macros
 
 %description
 Virtual machine serial console manager
@@ -30,8 +32,20 @@ ninja-build -C build-rpm
 export DESTDIR="%{buildroot}"
 ninja-build -C build-rpm install
 
+%post
+%systemd_post vlogd.service
+
+%preun
+%systemd_preun vlogd.service
+
+%postun
+%systemd_postun_with_restart vlogd.service
+
 %files
 %{_bindir}/vconsole
+%{_bindir}/vlog
+%{_bindir}/vlogd
+%{_unitdir}/vlogd.service
 %{_mandir}/man1/vconsole.1*
 /usr/share/applications/vconsole.desktop
 
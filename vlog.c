@@ -0,0 +1,324 @@
+#define _GNU_SOURCE /* strptime */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include <sys/stat.h>
+
+#include <glib.h>
+#include <zlib.h>
+
+#include "logwriter.h"
+
+#define APPNAME "vlog"
+
+/* ------------------------------------------------------------------ */
+
+int debug = 0;
+
+struct vlog_index {
+    int                       fd;
+    size_t                    count;
+};
+
+static bool vlog_index_open(struct vlog_index *idx, const char *logfile)
+{
+    char header[LOGWRITER_INDEX_HEADER];
+    char *idxname;
+    struct stat st;
+
+    idxname = g_strdup_printf("%s.idx", logfile);
+    idx->fd = open(idxname, O_RDONLY);
+    if (idx->fd < 0) {
+        fprintf(stderr, "open %s: %s\n", idxname, strerror(errno));
+        goto err;
+    }
+    if (read(idx->fd, header, sizeof(header)) != sizeof(header) ||
+        memcmp(header, LOGWRITER_INDEX_MAGIC,
+               strlen(LOGWRITER_INDEX_MAGIC)) != 0) {
+        fprintf(stderr, "%s: not a vconsole log index\n", idxname);
+        goto err;
+    }
+    fstat(idx->fd, &st);
+    idx->count = (st.st_size - LOGWRITER_INDEX_HEADER) /
+        sizeof(struct logwriter_index);
+    g_free(idxname);
+    return true;
+
+err:
+    if (idx->fd >= 0)
+        close(idx->fd);
+    g_free(idxname);
+    return false;
+}
+
+static void vlog_index_get(struct vlog_index *idx, size_t nr,
+                           gint64 *time, guint64 *offset)
+{
+    struct logwriter_index rec;
+    off_t pos = LOGWRITER_INDEX_HEADER + nr * sizeof(rec);
+
+    if (pread(idx->fd, &rec, sizeof(rec), pos) != sizeof(rec)) {
+        fprintf(stderr, "index read error\n");
+        exit(1);
+    }
+    *time = GUINT64_FROM_LE(rec.time);
+    *offset = GUINT64_FROM_LE(rec.offset);
+}
+
+/* binary search: number of index records with time <= t */
+static size_t vlog_index_find(struct vlog_index *idx, gint64 t)
+{
+    size_t lo = 0, hi = idx->count, mid;
+    guint64 offset;
+    gint64 time;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        vlog_index_get(idx, mid, &time, &offset);
+        if (time <= t)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* ------------------------------------------------------------------ */
+
+static gint64 parse_time(const char *arg)
+{
+    static const char *formats[] = {
+        "%Y-%m-%d %H:%M:%S",
+        "%Y-%m-%d %H:%M",
+        "%Y-%m-%d",
+        "%H:%M:%S",
+        "%H:%M",
+    };
+    struct tm tm, today;
+    time_t now;
+    char *end;
+    int i;
+
+    if (arg[0] == '@')
+        return g_ascii_strtoll(arg + 1, NULL, 10) * G_TIME_SPAN_SECOND;
+
+    now = time(NULL);
+    localtime_r(&now, &today);
+    for (i = 0; i < G_N_ELEMENTS(formats); i++) {
+        memset(&tm, 0, sizeof(tm));
+        end = strptime(arg, formats[i], &tm);
+        if (!end || *end)
+            continue;
+        if (!strchr(formats[i], 'Y')) {
+            tm.tm_year = today.tm_year;
+            tm.tm_mon  = today.tm_mon;
+            tm.tm_mday = today.tm_mday;
+        }
+        tm.tm_isdst = -1;
+        return (gint64)mktime(&tm) * G_TIME_SPAN_SECOND;
+    }
+    fprintf(stderr, "can't parse time: %s\n", arg);
+    exit(1);
+}
+
+static void print_index(struct vlog_index *idx)
+{
+    guint64 offset;
+    gint64 time;
+    time_t secs;
+    char buf[64];
+    size_t i;
+
+    for (i = 0; i < idx->count; i++) {
+        vlog_index_get(idx, i, &time, &offset);
+        secs = time / G_TIME_SPAN_SECOND;
+        strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", localtime(&secs));
+        printf("%s  %12" G_GUINT64_FORMAT "\n", buf, offset);
+    }
+}
+
+/* ------------------------------------------------------------------ */
+
+static void copy_plain(int fd, guint64 start, guint64 end)
+{
+    char buf[64 * 1024];
+    size_t len;
+    ssize_t rc;
+
+    while (start < end) {
+        len = MIN(sizeof(buf), end - start);
+        rc = pread(fd, buf, len, start);
+        if (rc <= 0)
+            break;
+        fwrite(buf, rc, 1, stdout);
+        start += rc;
+    }
+}
+
+/*
+ * Index points are either gzip member starts or full flush points in
+ * the middle of a member.  Start the latter as raw deflate stream,
+ * skip the member trailer at its end, gzip members follow.
+ */
+static void copy_gzip(int fd, guint64 start, guint64 end)
+{
+    unsigned char in[64 * 1024], out[64 * 1024], magic[2];
+    z_stream zs;
+    size_t len, skip = 0;
+    ssize_t rc;
+    int ret = Z_OK;
+    bool raw;
+
+    raw = !(pread(fd, magic, sizeof(magic), start) == sizeof(magic) &&
+            magic[0] == 0x1f && magic[1] == 0x8b);
+    if (debug)
+        fprintf(stderr, "%s: start at %s\n", __func__,
+                raw ? "flush point" : "gzip member");
+
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, raw ? -MAX_WBITS : MAX_WBITS + 16 /* gzip */) != Z_OK) {
+        fprintf(stderr, "inflateInit failed\n");
+        exit(1);
+    }
+    while (start < end) {
+        len = MIN(sizeof(in), end - start);
+        rc = pread(fd, in, len, start);
+        if (rc <= 0)
+            break;
+        start += rc;
+        zs.next_in = in;
+        zs.avail_in = rc;
+        do {
+            if (ret == Z_STREAM_END) {
+                if (raw) {
+                    /* end of deflate data, crc + size follow */
+                    inflateReset2(&zs, MAX_WBITS + 16);
+                    raw = false;
+                    skip = 8;
+                } else {
+                    inflateReset(&zs); /* next gzip member */
+                }
+                ret = Z_OK;
+            }
+            if (skip) {
+                len = MIN(skip, zs.avail_in);
+                zs.next_in += len;
+                zs.avail_in -= len;
+                skip -= len;
+                if (!zs.avail_in)
+                    break;
+            }
+            zs.next_out = out;
+            zs.avail_out = sizeof(out);
+            ret = inflate(&zs, Z_NO_FLUSH);
+            if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+                fprintf(stderr, "inflate: %s\n", zs.msg ? zs.msg : "error");
+                goto out;
+            }
+            fwrite(out, sizeof(out) - zs.avail_out, 1, stdout);
+        } while (zs.avail_in || zs.avail_out == 0);
+    }
+out:
+    inflateEnd(&zs);
+}
+
+/* ------------------------------------------------------------------ */
+
+static void usage(FILE *fp)
+{
+    fprintf(fp,
+	    "This prints a time range of a vconsole guest log\n"
+	    "\n"
+	    "usage: %s [ options ] <logfile>\n"
+	    "options:\n"
+	    "   -h          Print this text.\n"
+	    "   -d          Enable debugging.\n"
+	    "   -l          List index entries.\n"
+	    "   -f <time>   Start printing at <time>.\n"
+	    "   -t <time>   Stop printing at <time>.\n"
+	    "\n"
+	    "<time> is '[YYYY-MM-DD] HH:MM[:SS]', 'YYYY-MM-DD' or '@<epoch>'.\n",
+            APPNAME);
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct vlog_index idx;
+    gint64 from = 0, to = G_MAXINT64, time;
+    guint64 start = 0, end = G_MAXUINT64;
+    bool list = false;
+    char *logfile;
+    size_t nr;
+    int c, fd;
+
+    for (;;) {
+        if (-1 == (c = getopt(argc, argv, "hdlf:t:")))
+            break;
+        switch (c) {
+	case 'd':
+	    debug++;
+	    break;
+        case 'l':
+            list = true;
+            break;
+        case 'f':
+            from = parse_time(optarg);
+            break;
+        case 't':
+            to = parse_time(optarg);
+            break;
+        case 'h':
+            usage(stdout);
+            exit(0);
+        default:
+            usage(stderr);
+            exit(1);
+        }
+    }
+    if (optind + 1 != argc) {
+        usage(stderr);
+        exit(1);
+    }
+    logfile = argv[optind];
+
+    if (!vlog_index_open(&idx, logfile))
+        exit(1);
+    if (list) {
+        print_index(&idx);
+        exit(0);
+    }
+
+    /* start at the last index point before 'from' */
+    nr = vlog_index_find(&idx, from);
+    if (nr > 0)
+        vlog_index_get(&idx, nr - 1, &time, &start);
+
+    /* stop at the first index point after 'to' */
+    nr = vlog_index_find(&idx, to);
+    if (nr < idx.count)
+        vlog_index_get(&idx, nr, &time, &end);
+
+    if (debug)
+        fprintf(stderr, "%s: %zu index entries, range %" G_GUINT64_FORMAT
+                " - %" G_GUINT64_FORMAT "\n", __func__, idx.count, start, end);
+
+    fd = open(logfile, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "open %s: %s\n", logfile, strerror(errno));
+        exit(1);
+    }
+    if (g_str_has_suffix(logfile, ".gz"))
+        copy_gzip(fd, start, end);
+    else
+        copy_plain(fd, start, end);
+    close(fd);
+    exit(0);
+}
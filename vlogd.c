@@ -0,0 +1,399 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+
+#include <glib.h>
+#include <glib-unix.h>
+
+#include <libvirt/libvirt.h>
+#include <libvirt/virterror.h>
+
+#include "console.h"
+#include "logwriter.h"
+#include "libvirt-glib-event.h"
+
+#define APPNAME "vlogd"
+
+/* retry consoles which are busy (opened by someone else) */
+#define RETRY_INTERVAL 60
+
+/* reconnect backoff when libvirtd goes away, seconds */
+#define RECONNECT_MIN 1
+#define RECONNECT_MAX 60
+
+/* ------------------------------------------------------------------ */
+
+int debug = 0;
+
+struct vlogd_domain {
+    char                      uuid[VIR_UUID_STRING_BUFLEN];
+    char                      *name;
+    virDomainPtr              d;
+    struct console            console;
+    struct logwriter          *log;
+};
+
+static virConnectPtr conn;  /* NULL while disconnected */
+static const char *conn_uri;
+static int conn_event_id = -1;
+static int reconnect_delay = RECONNECT_MIN;
+static guint reconnect_timer;
+static char *hostname;
+static char *logdir;
+static GHashTable *domains;  /* uuid -> vlogd_domain, running guests */
+static GMainLoop *mainloop;
+
+/* console callbacks run on the main loop, one buffer is enough */
+static char rxbuf[CONSOLE_RXBUF_SIZE];
+
+/* ------------------------------------------------------------------ */
+
+static void domain_log_open(struct vlogd_domain *dom)
+{
+    static const char opened[] = "*** vlogd: log opened ***\n";
+    char *basename;
+
+    if (dom->log)
+        return;
+    basename = g_strdup_printf("%s/%s/%s", logdir, hostname, dom->name);
+    dom->log = logwriter_open(basename);
+    logwriter_write(dom->log, opened, sizeof(opened) - 1);
+    g_free(basename);
+}
+
+static void domain_log_close(struct vlogd_domain *dom)
+{
+    static const char closing[] = "\n*** vlogd: closing log ***\n";
+
+    if (!dom->log)
+        return;
+    logwriter_write(dom->log, closing, sizeof(closing) - 1);
+    logwriter_close(dom->log);
+    dom->log = NULL;
+}
+
+static void domain_console_data(void *opaque, const char *buf, int len)
+{
+    struct vlogd_domain *dom = opaque;
+
+    if (dom->log)
+        logwriter_write(dom->log, buf, len);
+}
+
+static void domain_console_hangup(void *opaque)
+{
+    struct vlogd_domain *dom = opaque;
+
+    domain_log_close(dom);
+}
+
+static const struct console_ops domain_console_ops = {
+    .data   = domain_console_data,
+    .hangup = domain_console_hangup,
+};
+
+static void domain_attach(struct vlogd_domain *dom)
+{
+    if (dom->console.stream)
+        return;
+
+    /* no force, don't steal the console from interactive users */
+    if (console_open(&dom->console, conn, dom->d, false) < 0)
+        return;
+    domain_log_open(dom);
+}
+
+static void domain_detach(struct vlogd_domain *dom)
+{
+    console_close(&dom->console);
+    domain_log_close(dom);
+}
+
+static void domain_free(gpointer data)
+{
+    struct vlogd_domain *dom = data;
+
+    domain_detach(dom);
+    virDomainFree(dom->d);
+    g_free(dom->name);
+    g_free(dom);
+}
+
+static struct vlogd_domain *domain_get(virDomainPtr d)
+{
+    char uuid[VIR_UUID_STRING_BUFLEN];
+    struct vlogd_domain *dom;
+
+    virDomainGetUUIDString(d, uuid);
+    dom = g_hash_table_lookup(domains, uuid);
+    if (dom)
+        return dom;
+
+    dom = g_new0(struct vlogd_domain, 1);
+    memcpy(dom->uuid, uuid, sizeof(uuid));
+    dom->name = g_strdup(virDomainGetName(d));
+    dom->d = d;
+    virDomainRef(d);
+    dom->console.name = dom->name;
+    dom->console.ops = &domain_console_ops;
+    dom->console.opaque = dom;
+    dom->console.rxbuf = rxbuf;
+    dom->console.rxbuf_size = sizeof(rxbuf);
+    g_hash_table_insert(domains, dom->uuid, dom);
+    return dom;
+}
+
+static void domain_remove(virDomainPtr d)
+{
+    char uuid[VIR_UUID_STRING_BUFLEN];
+
+    virDomainGetUUIDString(d, uuid);
+    g_hash_table_remove(domains, uuid);
+}
+
+static void domain_update(virConnectPtr c, virDomainPtr d, virDomainEventType event)
+{
+    const char *name = virDomainGetName(d);
+
+    switch (event) {
+    case VIR_DOMAIN_EVENT_STARTED:
+        if (debug)
+            fprintf(stderr, "%s: %s: started\n", __func__, name);
+        domain_attach(domain_get(d));
+        break;
+    case VIR_DOMAIN_EVENT_STOPPED:
+    case VIR_DOMAIN_EVENT_CRASHED:
+    case VIR_DOMAIN_EVENT_UNDEFINED:
+        if (debug)
+            fprintf(stderr, "%s: %s: gone\n", __func__, name);
+        domain_remove(d);
+        break;
+    default:
+        break;
+    }
+}
+
+static gboolean domain_retry(gpointer opaque)
+{
+    struct vlogd_domain *dom;
+    GHashTableIter iter;
+
+    g_hash_table_iter_init(&iter, domains);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&dom))
+        domain_attach(dom);
+    return TRUE;
+}
+
+/* ------------------------------------------------------------------ */
+
+static int connect_domain_event(virConnectPtr c, virDomainPtr d,
+                                int event, int detail, void *opaque)
+{
+    domain_update(c, d, event);
+    return 0;
+}
+
+static void connect_list(virConnectPtr c)
+{
+    virDomainPtr *list;
+    int i, n;
+
+    n = virConnectListAllDomains(c, &list, VIR_CONNECT_LIST_DOMAINS_ACTIVE);
+    if (n < 0)
+        return;
+    for (i = 0; i < n; i++) {
+        domain_attach(domain_get(list[i]));
+        virDomainFree(list[i]);
+    }
+    free(list);
+    if (debug)
+        fprintf(stderr, "%s: %d running guests\n", __func__, n);
+}
+
+static void connect_schedule(void);
+static void connect_close(virConnectPtr c, int reason, void *opaque);
+
+/*
+ * A dropped connection (libvirtd restart, remote host reboot) closes
+ * all consoles and logs, then vlogd reconnects with exponential
+ * backoff and picks up the running guests again.
+ */
+static gboolean connect_lost(gpointer opaque)
+{
+    if (!conn)
+        return FALSE;
+    g_hash_table_remove_all(domains);
+    if (conn_event_id >= 0)
+        virConnectDomainEventDeregisterAny(conn, conn_event_id);
+    conn_event_id = -1;
+    virConnectUnregisterCloseCallback(conn, connect_close);
+    virConnectClose(conn);
+    conn = NULL;
+    free(hostname);
+    hostname = NULL;
+    connect_schedule();
+    return FALSE;
+}
+
+static void connect_close(virConnectPtr c, int reason, void *opaque)
+{
+    if (debug)
+        fprintf(stderr, "%s: reason %d\n", __func__, reason);
+    /* not from within the libvirt callback */
+    g_idle_add(connect_lost, NULL);
+}
+
+static gboolean connect_open(gpointer opaque)
+{
+    reconnect_timer = 0;
+    conn = virConnectOpen(conn_uri);
+    if (conn == NULL) {
+        fprintf(stderr, "Failed to open connection to %s,"
+                " retry in %d seconds\n", conn_uri, reconnect_delay);
+        reconnect_delay = MIN(reconnect_delay * 2, RECONNECT_MAX);
+        connect_schedule();
+        return FALSE;
+    }
+    if (debug)
+        fprintf(stderr, "%s: connected to %s\n", __func__, conn_uri);
+    reconnect_delay = RECONNECT_MIN;
+    hostname = virConnectGetHostname(conn);
+
+    conn_event_id = virConnectDomainEventRegisterAny
+        (conn, NULL, VIR_DOMAIN_EVENT_ID_LIFECYCLE,
+         VIR_DOMAIN_EVENT_CALLBACK(connect_domain_event), NULL, NULL);
+    virConnectRegisterCloseCallback(conn, connect_close,
+                                    NULL, NULL);
+    connect_list(conn);
+    return FALSE;
+}
+
+static void connect_schedule(void)
+{
+    if (reconnect_timer)
+        return;
+    reconnect_timer = g_timeout_add_seconds(reconnect_delay,
+                                            connect_open, NULL);
+}
+
+static void connect_init(const char *uri)
+{
+    conn_uri = uri;
+    connect_open(NULL);
+}
+
+static gboolean quit_signal(gpointer opaque)
+{
+    g_main_loop_quit(mainloop);
+    return FALSE;
+}
+
+/* ------------------------------------------------------------------ */
+
+static void usage(FILE *fp)
+{
+    fprintf(fp,
+	    "This is a virtual machine console logger.\n"
+	    "It'll write the serial console output of all running guests to\n"
+	    "<dir>/<host>/<guest>.log\n"
+	    "\n"
+	    "usage: %s [ options ]\n"
+	    "options:\n"
+	    "   -h          Print this text.\n"
+	    "   -d          Enable debugging.\n"
+	    "   -c <uri>    Connect to libvirt.\n"
+	    "   -r <dir>    Log directory (default: ~/vconsole).\n"
+	    "   -n <count>  Max number of open log files (default: 256).\n"
+	    "   -z          Write gzip compressed logs.\n"
+	    "   -s <MB>     Rotate logs larger than this.\n"
+	    "   -a <hours>  Rotate logs older than this.\n"
+	    "   -q <MB>     Delete old rotated logs to stay below this.\n",
+            APPNAME);
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct logwriter_config cfg = {
+        .sync     = LOGWRITER_SYNC_INTERVAL,
+        .format   = LOGWRITER_FORMAT_PLAIN,
+        .max_open = 256,
+        .appname  = APPNAME,
+    };
+    char *uri = NULL;
+    int c;
+
+    for (;;) {
+        if (-1 == (c = getopt(argc, argv, "hdc:r:n:zs:a:q:")))
+            break;
+        switch (c) {
+	case 'd':
+	    debug++;
+	    break;
+        case 'c':
+            uri = optarg;
+            break;
+        case 'r':
+            logdir = optarg;
+            break;
+        case 'n':
+            cfg.max_open = atoi(optarg);
+            break;
+        case 'z':
+            cfg.format = LOGWRITER_FORMAT_GZIP;
+            break;
+        case 's':
+            cfg.rotate_size = g_ascii_strtoull(optarg, NULL, 10) * 1024 * 1024;
+            break;
+        case 'a':
+            cfg.rotate_age = atoi(optarg) * 60 * 60;
+            break;
+        case 'q':
+            cfg.quota = g_ascii_strtoull(optarg, NULL, 10) * 1024 * 1024;
+            break;
+        case 'h':
+            usage(stdout);
+            exit(0);
+        default:
+            usage(stderr);
+            exit(1);
+        }
+    }
+
+    if (uri == NULL)
+        uri = getenv("LIBVIRT_DEFAULT_URI");
+    if (uri == NULL)
+        uri = getenv("VIRSH_DEFAULT_CONNECT_URI");
+
+    if (uri == NULL) {
+        fprintf(stderr, "No libvirt uri\n");
+        exit(1);
+    }
+    if (logdir == NULL)
+        logdir = g_strdup_printf("%s/vconsole", getenv("HOME"));
+
+    /* init */
+    mainloop = g_main_loop_new(NULL, false);
+    gvir_event_register();
+    g_unix_signal_add(SIGINT, quit_signal, NULL);
+    g_unix_signal_add(SIGTERM, quit_signal, NULL);
+
+    cfg.topdir = logdir;
+    logwriter_init(&cfg);
+    domains = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                    NULL, domain_free);
+    connect_init(uri);
+    g_timeout_add_seconds(RETRY_INTERVAL, domain_retry, NULL);
+
+    /* main loop */
+    g_main_loop_run(mainloop);
+
+    /* cleanup */
+    g_hash_table_destroy(domains);
+    logwriter_fini();
+    exit(0);
+}
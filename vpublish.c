@@ -247,8 +247,9 @@ static void connect_init(const char *uri)
     if (debug)
         fprintf(stderr, "%s: connected to %s\n", __func__, uri);
 
-    virConnectDomainEventRegister(c, connect_domain_event,
-                                  NULL, NULL);
+    virConnectDomainEventRegisterAny
+        (c, NULL, VIR_DOMAIN_EVENT_ID_LIFECYCLE,
+         VIR_DOMAIN_EVENT_CALLBACK(connect_domain_event), NULL, NULL);
     virConnectRegisterCloseCallback(c, connect_close,
                                     NULL, NULL);
     connect_list(c);